@@ -1,15 +1,30 @@
+/* pread(), pwrite(), ftruncate() and friends, plus memfd_create() */
+#define _POSIX_C_SOURCE 200809L
+#define _GNU_SOURCE
+
 #include <stdio.h>
 #include <stdlib.h>
 #include <stdint.h>
 #include <string.h>
+#include <stdarg.h>
 #include <signal.h>
 #include <unistd.h>
 #include <fcntl.h>
+#include <pthread.h>
+#include <errno.h>
 
 #include <sys/time.h>
 #include <sys/types.h>
 #include <sys/termios.h>
 #include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/wait.h>
+#include <sys/stat.h>
+#include <dirent.h>
+
+/* part of the result cache key, bump when the VM's behaviour changes */
+#define LC3_VM_VERSION "1"
 
 /*** Memory Mapped Registers ***/
 enum
@@ -30,13 +45,90 @@ enum
 };
 
 
+/*** Scheduling ***/
+/*
+ * the VM runs as a coroutine: run_vm() executes at most one time slice
+ * and returns to the event loop in main() whenever the guest halts, would
+ * block on input, or polls an empty keyboard
+ *
+ * There is only one VM per process: the registers, memory, console and
+ * block caches are globals, not fields of a per-VM context. Running many
+ * guest sessions on one thread would need that state moved into a struct
+ * that run_vm() and the event loop switch between; until then, several
+ * sessions are served by separate processes (see --daemon).
+ */
+enum
+{
+	VM_HALTED = 0,  /* the program executed TRAP_HALT */
+	VM_YIELD,       /* the time slice ran out or KBSR was polled empty */
+	VM_BLOCKED,     /* TRAP_GETC / TRAP_IN are waiting for a key */
+	VM_BUDGET,      /* the instruction budget is used up */
+	VM_STOPPED      /* stop_vm() was called, e.g. by an output sink */
+};
+
+enum { VM_CONTINUE = -1 };  /* not a final state, the slice goes on */
+
+enum { TIME_SLICE = 1 << 16 };  /* instructions per time slice */
+
+int      slice_left;
+uint64_t instr_count;  /* instructions executed since the last reset */
+int      vm_stopped;
+volatile sig_atomic_t interrupted;  /* set by SIGINT, acted on between slices */
+
+/* --interpreter: how guest code is run */
+enum
+{
+	INTERP_TIERED = 0,  /* translated blocks, the switch loop for the rest */
+	INTERP_SWITCH,      /* the switch loop in run_vm() only */
+	INTERP_THREADED     /* tail calling handlers, see run_threaded() */
+};
+
+int interpreter = INTERP_TIERED;
+
+/* end the current time slice and do not start another one */
+void stop_vm()
+{
+	vm_stopped = 1;
+	instr_count -= slice_left;
+	slice_left = 0;
+}
+
+
 /*** Memory Storage ***/
 /* 
  * 16-bits
  * 65536 memory locations
  * 128kb
+ *
+ * memory is an anonymous mapping, so a page only costs host memory once
+ * it is written; untouched pages read from the kernel's shared zero page
+ */
+enum
+{
+	MEMORY_SIZE  = UINT16_MAX + 1,
+	MEMORY_BYTES = MEMORY_SIZE * sizeof(uint16_t),
+	PAGE_WORDS   = 2048,  /* 4kb */
+	PAGE_COUNT   = MEMORY_SIZE / PAGE_WORDS
+};
+
+uint16_t *memory;
+
+/*
+ * memory as it was after loading the images given on the command line;
+ * the daemon keeps it in a memfd (base_fd) that every job maps
+ * copy-on-write, so all workers share the pages of the image
  */
-uint16_t memory[UINT16_MAX];
+uint16_t *base_memory;
+int       base_fd = -1;
+
+/* bit n is set if page n holds image data */
+uint32_t loaded_pages, base_loaded_pages;
+
+/* one bit per word that was stored to since the image was loaded */
+uint32_t written[MEMORY_SIZE / 32];
+
+/* hash of the loaded images, identifies the program in the result cache */
+uint64_t image_hash, base_image_hash;
 
 
 /*** Register Storage ***/
@@ -116,6 +208,23 @@ uint16_t sign_extend(uint16_t x, int bit_count)
 	return x;
 }
 
+/* 64-bit FNV-1a, continuing from h (use hash_init() to start) */
+uint64_t hash_bytes(uint64_t h, const void *data, size_t len)
+{
+	const unsigned char *p = data;
+
+	while (len-- > 0) {
+		h ^= *p++;
+		h *= 1099511628211ULL;
+	}
+	return h;
+}
+
+uint64_t hash_init()
+{
+	return 14695981039346656037ULL;
+}
+
 /* little endian to big endian */
 uint16_t swap16(uint16_t x)
 {
@@ -133,6 +242,12 @@ void update_flags(uint16_t r)
 	}
 }
 
+/* the condition codes for a result */
+uint16_t flags_of(uint16_t value)
+{
+	return value == 0 ? FL_ZRO : value >> 15 ? FL_NEG : FL_POS;
+}
+
 /* reading program into memory */
 void read_image_file(FILE *file)
 {
@@ -142,10 +257,21 @@ void read_image_file(FILE *file)
 	origin = swap16(origin);
 
 	/* we know the maximum file size so we only need one fread */
-	uint16_t max_read = UINT16_MAX - origin;
+	size_t max_read = MEMORY_SIZE - origin;
 	uint16_t *p = memory + origin;
 	size_t read = fread(p, sizeof(uint16_t), max_read, file);
 
+	for (size_t page = origin / PAGE_WORDS; page * PAGE_WORDS < origin + read; page++) {
+		loaded_pages |= (uint32_t) 1 << page;
+	}
+	memset(written, 0, sizeof(written));
+
+	if (!image_hash) {
+		image_hash = hash_init();
+	}
+	image_hash = hash_bytes(image_hash, &origin, sizeof(origin));
+	image_hash = hash_bytes(image_hash, p, read * sizeof(uint16_t));
+
 	/* swap to little endian */
 	while (read-- > 0) {
 		*p = swap16(*p);
@@ -153,439 +279,3619 @@ void read_image_file(FILE *file)
 	}
 }
 
-int read_image(const char *image_path)
+uint16_t *alloc_memory()
 {
-	FILE *file = fopen(image_path, "rb");
+	void *p = mmap(NULL, MEMORY_BYTES, PROT_READ | PROT_WRITE,
+	               MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	return p == MAP_FAILED ? NULL : p;
+}
 
-	if (!file) {
-		return 0;
+/* zero memory by mapping fresh anonymous pages over it */
+void clear_memory()
+{
+	if (mmap(memory, MEMORY_BYTES, PROT_READ | PROT_WRITE,
+	         MAP_PRIVATE | MAP_ANONYMOUS | MAP_FIXED, -1, 0) == MAP_FAILED) {
+		memset(memory, 0, MEMORY_BYTES);
 	}
+	loaded_pages = 0;
+	memset(written, 0, sizeof(written));
+}
 
-	read_image_file(file);
-	fclose(file);
+/* put the command line images into base_fd, returns 0 if memfd is unavailable */
+int share_base_memory()
+{
+	int fd = memfd_create("lc3-image", MFD_CLOEXEC);
+
+	if (fd < 0 || ftruncate(fd, MEMORY_BYTES) < 0) {
+		goto fail;
+	}
+	for (int page = 0; page < PAGE_COUNT; page++) {
+		if (!(base_loaded_pages & ((uint32_t) 1 << page))) {
+			continue;
+		}
+		size_t len = PAGE_WORDS * sizeof(uint16_t);
+		if (pwrite(fd, base_memory + page * PAGE_WORDS, len, page * len) != (ssize_t) len) {
+			goto fail;
+		}
+	}
+	base_fd = fd;
 	return 1;
+
+fail:
+	if (fd >= 0) {
+		close(fd);
+	}
+	return 0;
 }
 
-uint16_t check_key()
+/* reload the command line images */
+void restore_base_memory()
 {
-	fd_set readfds;
-	FD_ZERO(&readfds);
-	FD_SET(STDIN_FILENO, &readfds);
+	image_hash = base_image_hash;
+	loaded_pages = base_loaded_pages;
+	memset(written, 0, sizeof(written));
+
+	/* share the image's pages until the guest writes to them */
+	if (base_fd >= 0 && mmap(memory, MEMORY_BYTES, PROT_READ | PROT_WRITE,
+	                         MAP_PRIVATE | MAP_FIXED, base_fd, 0) != MAP_FAILED) {
+		return;
+	}
 
-	struct timeval timeout;
-	timeout.tv_sec = 0;
-	timeout.tv_usec = 0;
-	return select(1, &readfds, NULL, NULL, &timeout) != 0;
+	/* otherwise copy only the pages the images occupy */
+	clear_memory();
+	loaded_pages = base_loaded_pages;
+	for (int page = 0; page < PAGE_COUNT; page++) {
+		if (base_loaded_pages & ((uint32_t) 1 << page)) {
+			memcpy(memory + page * PAGE_WORDS, base_memory + page * PAGE_WORDS,
+			       PAGE_WORDS * sizeof(uint16_t));
+		}
+	}
 }
 
-/*** Memory Access ***/
-void mem_write(uint16_t address, uint16_t value)
+/*
+ * labels from the .sym files lc3as writes next to the images, kept sorted
+ * by address so naming an address is a binary search for the closest
+ * label at or below it. A daemon job's images bring their own symbols,
+ * which are kept from symbol_first on and dropped when the job ends.
+ */
+struct symbol
 {
-	memory[address] = value;
+	uint16_t address;
+	char     name[32];
+};
+
+struct symbol *symbols;
+int symbol_count, symbol_capacity, symbol_first;
+
+int compare_symbols(const void *a, const void *b)
+{
+	const struct symbol *x = a, *y = b;
+	return (x->address > y->address) - (x->address < y->address);
 }
 
-uint16_t mem_read(uint16_t address)
+/* load the .sym file next to an image, if there is one */
+void load_symbols(const char *image_path)
 {
-	if (address == MR_KBSR) {
-		if (check_key()) {
-			memory[MR_KBSR] = (1 << 15);
-			memory[MR_KBDR] = getchar();
-		} else {
-			memory[MR_KBSR] = 0;
-		}
+	char path[4096], line[256], name[sizeof(line)];
+	size_t len = strlen(image_path);
+
+	if (len >= 4 && strcmp(image_path + len - 4, ".obj") == 0) {
+		len -= 4;
 	}
-	return memory[address];
-}
+	if (len + 5 > sizeof(path)) {
+		return;
+	}
+	memcpy(path, image_path, len);
+	strcpy(path + len, ".sym");
 
-/*** UNIX Setting Up Terminal Input Buffering ***/
-struct termios original_tio;
+	FILE *file = fopen(path, "r");
+	if (!file) {
+		return;
+	}
 
-void disable_input_buffering()
-{
-	tcgetattr(STDIN_FILENO, &original_tio);
-	struct termios new_tio = original_tio;
-	new_tio.c_lflag &= ~ICANON & ~ECHO;
-	tcsetattr(STDIN_FILENO, TCSANOW, &new_tio);
+	/* entries are "//<tab>NAME  ADDRESS", the header lines do not parse */
+	while (fgets(line, sizeof(line), file)) {
+		struct symbol sym;
+		unsigned address;
+		int c;
+
+		/* a line that does not fit is no entry, and its tail must not parse as one */
+		if (!strchr(line, '\n') && !feof(file)) {
+			while ((c = fgetc(file)) != EOF && c != '\n') {
+			}
+			continue;
+		}
+		/* names longer than sym.name are skipped, not cut short */
+		if (sscanf(line, "//%255s %x", name, &address) != 2 || address > UINT16_MAX
+		    || strlen(name) >= sizeof(sym.name)) {
+			continue;
+		}
+		strcpy(sym.name, name);
+		if (symbol_count == symbol_capacity) {
+			int capacity = symbol_capacity ? symbol_capacity * 2 : 64;
+			struct symbol *grown = realloc(symbols, capacity * sizeof(*symbols));
+			if (!grown) {
+				break;
+			}
+			symbols = grown;
+			symbol_capacity = capacity;
+		}
+		sym.address = address;
+		symbols[symbol_count++] = sym;
+	}
+	fclose(file);
+
+	qsort(symbols + symbol_first, symbol_count - symbol_first, sizeof(*symbols), compare_symbols);
 }
 
-void restore_input_buffering()
+/* the closest symbol at or below an address, NULL if there is none */
+const struct symbol *find_symbol(uint16_t address)
 {
-	tcsetattr(STDIN_FILENO, TCSANOW, &original_tio);
+	int lo = symbol_first, hi = symbol_count;
+
+	while (lo < hi) {
+		int mid = (lo + hi) / 2;
+		if (symbols[mid].address <= address) {
+			lo = mid + 1;
+		} else {
+			hi = mid;
+		}
+	}
+	return lo > symbol_first ? &symbols[lo - 1] : NULL;
 }
 
-void handle_interrupt(int signal)
+/* "x3004", or "x3004<LOOP+2>" when a symbol covers it */
+int format_address(char *buf, size_t size, uint16_t address)
 {
-	restore_input_buffering();
-	printf("\n");
-	exit(-2);
+	const struct symbol *sym = find_symbol(address);
+
+	if (!sym) {
+		return snprintf(buf, size, "x%04X", address);
+	}
+	if (sym->address == address) {
+		return snprintf(buf, size, "x%04X<%s>", address, sym->name);
+	}
+	return snprintf(buf, size, "x%04X<%s+%d>", address, sym->name, address - sym->address);
 }
 
-/*** ADD ***/
-void op_ADD(uint16_t instr)
+int read_image(const char *image_path)
 {
-	/* destination register (DR) */
-	uint16_t  DR = (instr >> 9) & 0x7;
-	/* first operand (SR1) */
-	uint16_t SR1 = (instr >> 6) & 0x7;
-	/* whether we are in immediate mode */
-	uint16_t imm_flag = (instr >> 5) & 0x1;
+	FILE *file = fopen(image_path, "rb");
 
-	if (imm_flag) {
-		uint16_t imm5 = sign_extend(instr & 0x1F, 5);
-		reg[DR] = reg[SR1] + imm5;
-	} else {
-		uint16_t SR2 = instr & 0x7;
-		reg[DR] = reg[SR1] + reg[SR2];
+	if (!file) {
+		return 0;
 	}
 
-	update_flags(DR);
+	read_image_file(file);
+	fclose(file);
+	load_symbols(image_path);
+	return 1;
 }
 
-/*** AND ***/
-void op_AND(uint16_t instr)
+/* load an image that is already in memory, e.g. sent to the daemon */
+int read_image_data(const char *data, size_t len)
 {
-	/* destination register (DR) */
-	uint16_t  DR = (instr >> 9) & 0x7;
-	/* first operand (SR1) */
-	uint16_t SR1 = (instr >> 6) & 0x7;
-	/* whether we are in immediate mode */
-	uint16_t imm_flag = (instr >> 5) & 0x1;
+	FILE *file = fmemopen((void *) data, len, "rb");
 
-	if (imm_flag) {
-		uint16_t imm5 = sign_extend(instr & 0x1F, 5);
-		reg[DR] = reg[SR1] & imm5;
-	} else {
-		uint16_t SR2 = instr & 0x7;
-		reg[DR] = reg[SR1] & reg[SR2];
+	if (!file) {
+		return 0;
 	}
 
-	update_flags(DR);
+	read_image_file(file);
+	fclose(file);
+	return 1;
 }
 
-/*** NOT ***/
-void op_NOT(uint16_t instr)
+/* size of the console buffers and of the writer's spill file reads */
+enum { CONSOLE_BUF_SIZE = 4096, CHUNK_SIZE = 4096 };
+
+
+/* read a whole file, returns NULL if it cannot be read */
+char *read_file(const char *path, size_t *len)
 {
-	/* destination register (DR) */
-	uint16_t DR = (instr >> 9) & 0x7;
-	/* source register (SR) */
-	uint16_t SR = (instr >> 6) & 0x7;
+	FILE *file = fopen(path, "rb");
+	char *data = NULL;
+	size_t size = 0;
 
-	reg[DR] = ~reg[SR];
+	if (!file) {
+		return NULL;
+	}
 
-	update_flags(DR);
+	for (;;) {
+		char *grown = realloc(data, size + CHUNK_SIZE);
+		if (!grown) {
+			free(data);
+			fclose(file);
+			return NULL;
+		}
+		data = grown;
+
+		size_t n = fread(data + size, 1, CHUNK_SIZE, file);
+		size += n;
+		if (n < CHUNK_SIZE) {
+			break;
+		}
+	}
+
+	fclose(file);
+	*len = size;
+	return data;
 }
 
-/*** BR ***/
-void op_BR(uint16_t instr)
+
+/*** Output Writer ***/
+/*
+ * console output is handed to a writer thread through a single-producer
+ * single-consumer ring, so the guest keeps running while the host writes
+ * to a slow stdout; out_policy decides what happens when the ring is full
+ */
+enum
 {
-	/* PCoffset9 */
-	uint16_t PC_offset = sign_extend(instr & 0x1ff, 9);
-	/* conditional flags */
-	uint16_t cond_flag = (instr >> 9) & 0x7;
+	OUT_BLOCK = 0,  /* wait for the writer to make room */
+	OUT_DROP,       /* discard the output and count it */
+	OUT_SPILL       /* append to a temporary file drained by the writer */
+};
 
-	if (cond_flag & reg[R_COND]) {
-		reg[R_PC] += PC_offset;
-	}	
+enum { RING_SIZE = 1 << 16 };  /* must be a power of two */
+
+char   ring[RING_SIZE];
+size_t ring_head;  /* consumer position, written by the writer thread */
+size_t ring_tail;  /* producer position, written by the VM thread     */
+
+int    out_policy = OUT_BLOCK;
+size_t out_dropped;  /* with OUT_SPILL, guarded by ring_lock */
+
+/* spill file state is shared by both threads and guarded by ring_lock */
+int    spill_fd = -1;
+off_t  spill_read, spill_write;
+
+int             writer_running;
+int             writer_stopping;
+pthread_t       writer_thread;
+pthread_mutex_t ring_lock  = PTHREAD_MUTEX_INITIALIZER;
+pthread_cond_t  ring_data  = PTHREAD_COND_INITIALIZER;
+pthread_cond_t  ring_space = PTHREAD_COND_INITIALIZER;
+
+void write_all(int fd, const char *buf, size_t len)
+{
+	while (len > 0) {
+		ssize_t n = write(fd, buf, len);
+		if (n <= 0) {
+			return;
+		}
+		buf += n;
+		len -= n;
+	}
 }
 
-/*** JMP ***/
-void op_JMP(uint16_t instr)
+void write_stdout(const char *buf, size_t len)
 {
-	/* base register */
-	uint16_t BaseR = (instr >> 6) & 0x7;
+	write_all(STDOUT_FILENO, buf, len);
+}
 
-	reg[R_PC] = reg[BaseR];
+size_t ring_used()
+{
+	return __atomic_load_n(&ring_tail, __ATOMIC_ACQUIRE)
+	     - __atomic_load_n(&ring_head, __ATOMIC_ACQUIRE);
 }
 
-/*** JSR ***/
-void op_JSR(uint16_t instr)
+/* copy as much of buf into the ring as fits, returns the amount copied */
+size_t ring_push(const char *buf, size_t len)
 {
-	reg[R_R7] = reg[R_PC];
+	size_t tail = ring_tail;
+	size_t head = __atomic_load_n(&ring_head, __ATOMIC_ACQUIRE);
+	size_t room = RING_SIZE - (tail - head);
 
-/*JSR*/ if ((instr >> 11) & 1) {
-		/* PCoffset11 */
-		uint16_t PC_offset = sign_extend(instr & 0x7ff, 11);
-		reg[R_PC] += PC_offset;
-/*JSRR*/} else {
-		/* base register */
-		uint16_t BaseR = (instr >> 6) & 0x7;
-		reg[R_PC] = reg[BaseR];
+	if (len > room) {
+		len = room;
+	}
+	for (size_t i = 0; i < len; i++) {
+		ring[(tail + i) & (RING_SIZE - 1)] = buf[i];
 	}
+	__atomic_store_n(&ring_tail, tail + len, __ATOMIC_RELEASE);
+	return len;
 }
 
-/*** LD ***/
-void op_LD(uint16_t instr)
+/* append to the spill file, with ring_lock held; what cannot be written is dropped */
+void spill(const char *buf, size_t len)
 {
-	/* destination register (DR) */
-	uint16_t DR = (instr >> 9) & 0x7;
-	/* PCoffset9 */
-	uint16_t PC_offset = sign_extend(instr & 0x1ff, 9);
+	while (len > 0) {
+		ssize_t n = pwrite(spill_fd, buf, len, spill_write);
+		if (n <= 0) {
+			out_dropped += len;
+			return;
+		}
+		buf += n;
+		len -= n;
+		spill_write += n;
+	}
+}
 
-	/* add pc_offset to the current PC, look at that memory location to get the final value */
-	reg[DR] = mem_read(reg[R_PC] + PC_offset);
+/* SIGINT is for the main thread, so it can break out of select() */
+void block_interrupt()
+{
+	sigset_t set;
 
-	update_flags(DR);
+	sigemptyset(&set);
+	sigaddset(&set, SIGINT);
+	pthread_sigmask(SIG_BLOCK, &set, NULL);
 }
 
-/*** LDI ***/
-void op_LDI(uint16_t instr)
+void *writer_main(void *arg)
 {
-	/* destination register (DR) */
-	uint16_t DR = (instr >> 9) & 0x7;
-	/* PCoffset9 */
-	uint16_t PC_offset = sign_extend(instr & 0x1ff, 9);
+	char chunk[CHUNK_SIZE];
+	(void) arg;
 
-	/* add pc_offset to the current PC, look at that memory location to get the final address */
-	reg[DR] = mem_read(mem_read(reg[R_PC] + PC_offset));
+	block_interrupt();
 
-	update_flags(DR);
-}
+	for (;;) {
+		size_t head = ring_head;
+		size_t tail = __atomic_load_n(&ring_tail, __ATOMIC_ACQUIRE);
 
-/*** LDR ***/
-void op_LDR(uint16_t instr)
-{
-	/* destination register (DR) */
-	uint16_t     DR = (instr >> 9) & 0x7;
-	/* base register (BaseR) */
-	uint16_t  BaseR = (instr >> 6) & 0x7;
+		if (head != tail) {
+			/* write the contiguous part of the ring in one go */
+			size_t start = head & (RING_SIZE - 1);
+			size_t len = tail - head;
+			if (len > RING_SIZE - start) {
+				len = RING_SIZE - start;
+			}
+			write_all(STDOUT_FILENO, ring + start, len);
+			__atomic_store_n(&ring_head, head + len, __ATOMIC_RELEASE);
+
+			pthread_mutex_lock(&ring_lock);
+			pthread_cond_signal(&ring_space);
+			pthread_mutex_unlock(&ring_lock);
+			continue;
+		}
+
+		pthread_mutex_lock(&ring_lock);
+		if (ring_used() != 0) {
+			/* the ring was refilled before the spill started, keep the order */
+			pthread_mutex_unlock(&ring_lock);
+			continue;
+		}
+		if (spill_read < spill_write) {
+			ssize_t n = pread(spill_fd, chunk, sizeof(chunk), spill_read);
+			pthread_mutex_unlock(&ring_lock);
+			if (n < 0 && errno == EINTR) {
+				continue;
+			}
+			if (n > 0) {
+				write_all(STDOUT_FILENO, chunk, n);
+			}
+			pthread_mutex_lock(&ring_lock);
+			if (n <= 0) {
+				/* the rest of the spill cannot be read back, count it and go on */
+				out_dropped += spill_write - spill_read;
+				spill_read = spill_write;
+			} else {
+				spill_read += n;
+			}
+			if (spill_read == spill_write) {
+				/* spill drained, the VM may use the ring again */
+				spill_read = spill_write = 0;
+				if (ftruncate(spill_fd, 0) < 0) {
+					/* only costs disk space, writing starts over at 0 anyway */
+				}
+			}
+			pthread_mutex_unlock(&ring_lock);
+			continue;
+		}
+		if (writer_stopping) {
+			pthread_mutex_unlock(&ring_lock);
+			break;
+		}
+		pthread_cond_wait(&ring_data, &ring_lock);
+		pthread_mutex_unlock(&ring_lock);
+	}
+	return NULL;
+}
+
+int writer_start()
+{
+	if (out_policy == OUT_SPILL) {
+		FILE *f = tmpfile();
+		if (!f) {
+			return 0;
+		}
+		spill_fd = dup(fileno(f));
+		fclose(f);
+	}
+
+	writer_running = pthread_create(&writer_thread, NULL, writer_main, NULL) == 0;
+	return writer_running;
+}
+
+/* drain everything that is queued and join the writer thread */
+void writer_stop()
+{
+	if (!writer_running) {
+		return;
+	}
+
+	pthread_mutex_lock(&ring_lock);
+	writer_stopping = 1;
+	pthread_cond_signal(&ring_data);
+	pthread_mutex_unlock(&ring_lock);
+
+	pthread_join(writer_thread, NULL);
+	writer_running = 0;
+
+	if (out_dropped) {
+		fprintf(stderr, "%zu bytes of output dropped\n", out_dropped);
+	}
+}
+
+void writer_push(const char *buf, size_t len)
+{
+	pthread_mutex_lock(&ring_lock);
+	if (spill_read < spill_write) {
+		/* older output is still in the spill file, append behind it */
+		spill(buf, len);
+		len = 0;
+	}
+	pthread_mutex_unlock(&ring_lock);
+
+	while (len > 0) {
+		size_t n = ring_push(buf, len);
+		buf += n;
+		len -= n;
+		if (len == 0) {
+			break;
+		}
+
+		if (out_policy == OUT_DROP) {
+			out_dropped += len;
+			break;
+		}
+
+		pthread_mutex_lock(&ring_lock);
+		if (out_policy == OUT_SPILL) {
+			spill(buf, len);
+			len = 0;
+		} else if (ring_used() == RING_SIZE) {
+			pthread_cond_signal(&ring_data);
+			pthread_cond_wait(&ring_space, &ring_lock);
+		}
+		pthread_mutex_unlock(&ring_lock);
+	}
+
+	pthread_mutex_lock(&ring_lock);
+	pthread_cond_signal(&ring_data);
+	pthread_mutex_unlock(&ring_lock);
+}
+
+/*** Console I/O ***/
+/*
+ * guest output is collected in out_buf and written with one write() when
+ * the VM suspends or the buffer fills up; input is read in bulk into
+ * in_buf and handed out one character at a time
+ */
+char   out_buf[CONSOLE_BUF_SIZE];
+size_t out_len;
+
+/* in_data points at in_buf, or at the whole input of a daemon job */
+char        in_buf[CONSOLE_BUF_SIZE];
+const char *in_data = in_buf;
+size_t      in_head, in_tail;
+int         in_eof;
+int         in_prompted;  /* TRAP_IN printed its prompt but got no key yet */
+
+/* where console_flush() sends the output */
+void (*out_sink)(const char *buf, size_t len) = write_stdout;
+
+/* hand every character to out_sink as it is written, for sinks that can stop the VM */
+int out_unbuffered;
+
+/* a copy of all output, kept while a run is recorded for the result cache */
+int    recording;
+char  *record_buf;
+size_t record_len, record_cap;
+
+void console_flush()
+{
+	if (recording && record_len + out_len > record_cap) {
+		size_t cap = record_cap ? record_cap : CONSOLE_BUF_SIZE;
+		while (cap < record_len + out_len) {
+			cap *= 2;
+		}
+
+		char *grown = realloc(record_buf, cap);
+		if (grown) {
+			record_buf = grown;
+			record_cap = cap;
+		} else {
+			recording = 0;
+		}
+	}
+	if (recording) {
+		memcpy(record_buf + record_len, out_buf, out_len);
+		record_len += out_len;
+	}
+
+	if (out_len > 0) {
+		out_sink(out_buf, out_len);
+	}
+	out_len = 0;
+}
+
+void console_putc(char c)
+{
+	if (out_len == CONSOLE_BUF_SIZE) {
+		console_flush();
+	}
+	out_buf[out_len++] = c;
+	if (out_unbuffered) {
+		console_flush();
+	}
+}
+
+void console_puts(const char *s)
+{
+	while (*s) {
+		console_putc(*s++);
+	}
+}
+
+/* returns 1 if console_getc() will not block, refilling in_buf if needed */
+int console_poll()
+{
+	if (in_head < in_tail || in_eof) {
+		return 1;
+	}
+
+	fd_set readfds;
+	FD_ZERO(&readfds);
+	FD_SET(STDIN_FILENO, &readfds);
+
+	struct timeval timeout;
+	timeout.tv_sec = 0;
+	timeout.tv_usec = 0;
+	if (select(1, &readfds, NULL, NULL, &timeout) <= 0) {
+		return 0;
+	}
+
+	ssize_t n = read(STDIN_FILENO, in_buf, sizeof(in_buf));
+	if (n <= 0) {
+		in_eof = 1;
+	} else {
+		in_data = in_buf;
+		in_head = 0;
+		in_tail = n;
+	}
+	return 1;
+}
+
+/* returns EOF once the input is exhausted */
+int console_getc()
+{
+	if (in_head < in_tail) {
+		return (unsigned char) in_data[in_head++];
+	}
+	return EOF;
+}
+
+uint16_t check_key()
+{
+	return console_poll();
+}
+
+/* sleep until a key is available (the event loop's suspend point) */
+void wait_key()
+{
+	fd_set readfds;
+	FD_ZERO(&readfds);
+	FD_SET(STDIN_FILENO, &readfds);
+
+	console_flush();
+	select(1, &readfds, NULL, NULL, NULL);
+}
+
+/*** Translation Cache ***/
+/*
+ * execution is tiered: code starts out in the interpreter, an address
+ * that was reached TIER1_THRESHOLD times is translated into a block of
+ * predecoded micro-ops (see translate()), and a block that ran
+ * TIER2_THRESHOLD times is handed to a background thread that optimizes
+ * it (see optimize()) while the guest keeps running the baseline block.
+ * Loop headers (the targets of backward branches) are compiled after
+ * OSR_THRESHOLD runs, and a running loop switches to the optimized
+ * block at its next iteration instead of waiting for the time slice to
+ * end; the registers are shared by all tiers, so nothing is transferred.
+ *
+ * Baseline blocks never cross a page; every page keeps a list of the
+ * baseline blocks translated from it, and a bitmap marks the words they
+ * were translated from, so only stores into code need checking. Such a
+ * store drops just the baseline blocks covering the word, and all the
+ * optimized blocks, which are rebuilt from the baseline blocks left.
+ *
+ * The cache belongs to the image it was built for (cache_image_hash):
+ * the daemon and the test suite translate the command line images once
+ * before forking, so every worker starts with the same warm cache, and
+ * keep it across jobs as long as the memory the blocks were read from
+ * still holds the loaded image.
+ *
+ * The arena blocks are allocated from is split into ARENA_REGIONS regions
+ * filled one after the other; when the arena is full, the oldest region
+ * is evicted, so the cache stays within ARENA_SIZE however many images a
+ * daemon worker runs.
+ */
+enum
+{
+	BLOCK_MAX_OPS   = 32,
+	TIER2_MAX_OPS   = 64,
+	ARENA_SIZE      = 1 << 20,  /* bytes of translated blocks */
+	ARENA_REGIONS   = 4,
+	REGION_SIZE     = ARENA_SIZE / ARENA_REGIONS,
+	TIER1_THRESHOLD = 16,
+	TIER2_THRESHOLD = 1000,
+	OSR_THRESHOLD   = 100
+};
+
+/* micro-ops; addresses and offsets are resolved at translation time */
+enum
+{
+	U_ADD = 0,  /* DR = SR1 + SR2              */
+	U_ADDI,     /* DR = SR1 + imm              */
+	U_AND,      /* DR = SR1 & SR2              */
+	U_ANDI,     /* DR = SR1 & imm              */
+	U_NOT,      /* DR = ~SR1                   */
+	U_LD,       /* DR = mem[imm]               */
+	U_LDI,      /* DR = mem[mem[imm]]          */
+	U_LDR,      /* DR = mem[SR1 + imm]         */
+	U_LEA,      /* DR = imm                    */
+	U_SETI,     /* AND DR, DR, #0; ADD DR, DR, #imm */
+	U_ST,       /* mem[imm] = DR               */
+	U_STI,      /* mem[mem[imm]] = DR          */
+	U_STR,      /* mem[SR1 + imm] = DR         */
+	U_LD_ADDI_ST,    /* LD DR, imm; ADD DR, DR, #aux; ST DR, imm */
+	U_LDR_ADDI_STR,  /* the same with mem[SR1 + imm] */
+	U_GUARD,    /* leave for imm unless COND & DR matches UF_TAKEN */
+	/* the last micro-op of a block is always one of these exits */
+	U_BR,       /* goto imm if COND & DR, else fall through */
+	U_ADDI_BR,  /* DR = SR1 + aux, then BR with condition SR2 */
+	U_JMP,      /* goto SR1                    */
+	U_RET,      /* goto R7                     */
+	U_JSR,      /* R7 = PC + 1, goto imm       */
+	U_JSRR,     /* R7 = PC + 1, goto SR1       */
+	U_EXIT      /* goto imm (in the interpreter if it has no block) */
+};
+
+enum
+{
+	UF_CC    = 1 << 0,  /* the micro-op sets the condition codes */
+	UF_TAKEN = 1 << 1   /* a guard stays on the branch taken path */
+};
+
+struct uop
+{
+	uint8_t  op;     /* U_* */
+	uint8_t  dr;     /* destination or stored register, BR condition */
+	uint8_t  sr1;    /* first operand or base register */
+	uint8_t  sr2;    /* second operand */
+	uint8_t  flags;  /* UF_* */
+	uint8_t  n;      /* guest instructions done once this one is */
+	int8_t   aux;    /* second immediate of a fused micro-op */
+	uint16_t imm;    /* immediate, offset or absolute address */
+	uint16_t pc;     /* address of the guest instruction */
+};
+
+/* guest instructions a micro-op stands for */
+int uop_width(int op)
+{
+	switch (op) {
+	case U_EXIT:
+		return 0;
+	case U_SETI:
+	case U_ADDI_BR:
+		return 2;
+	case U_LD_ADDI_ST:
+	case U_LDR_ADDI_STR:
+		return 3;
+	}
+	return 1;
+}
+
+/* does the micro-op write DR */
+int writes_dr(int op)
+{
+	return op < U_ST || op == U_LD_ADDI_ST || op == U_LDR_ADDI_STR || op == U_ADDI_BR;
+}
+
+struct block
+{
+	uint16_t      start, end;  /* guest addresses [start, end) */
+	uint16_t      count;       /* guest instructions */
+	uint16_t      len;         /* micro-ops */
+	uint32_t      runs;        /* times the block was executed */
+	uint32_t      taken;       /* times its final branch was taken */
+	uint8_t       tier;        /* 1 baseline, 2 optimized */
+	uint8_t       queued;      /* handed to the compile thread */
+	struct block *page_next;   /* next block from the same page, or optimized block */
+	struct block *base;        /* baseline block an optimized one replaces */
+	struct uop    ops[];
+};
+
+struct block *block_map[MEMORY_SIZE];   /* block starting at each address */
+struct block *page_blocks[PAGE_COUNT];  /* blocks translated from each page */
+struct block *tier2_blocks;             /* optimized blocks */
+uint32_t      code_words[MEMORY_SIZE / 32];  /* words blocks were translated from */
+
+unsigned char arena[ARENA_SIZE];
+size_t        region_used[ARENA_REGIONS];
+int           region;  /* the region blocks are allocated from */
+
+struct
+{
+	uint64_t translated;   /* baseline blocks */
+	uint64_t optimized;    /* blocks installed from the compile thread */
+	uint64_t evictions;    /* regions evicted */
+	uint64_t flushes;
+	uint64_t invalidations;
+	uint64_t in_blocks;    /* instructions run in blocks */
+	uint64_t interpreted;  /* instructions run by the interpreter */
+} cache_stats;
+
+uint64_t cache_image_hash;  /* image the cache is valid for, 0 if none */
+uint64_t cache_gen;         /* bumped by every flush */
+uint64_t link_gen;          /* bumped by flushes and by installing optimized blocks */
+int      cache_flushed;     /* set when blocks are dropped under a running block */
+
+/*
+ * return address stack: JSR and JSRR push the block they return to, and
+ * a RET that comes back to the pushed address continues in that block
+ * without going through run_vm()
+ */
+enum { RAS_SIZE = 16 };
+
+struct ras_entry
+{
+	uint16_t      pc;
+	struct block *b;    /* block_map[pc] at the time of the call, if any */
+	uint64_t      gen;  /* link_gen at the time of the call */
+};
+
+struct ras_entry ras[RAS_SIZE];
+unsigned         ras_top;
+
+/*
+ * inline caches for JMP and JSRR: each site remembers the last few
+ * targets it jumped to and their blocks, so a dispatch table or a
+ * function pointer continues in its target block the way a return does
+ */
+enum { IC_SIZE = 256, IC_WAYS = 4 };
+
+struct inline_cache
+{
+	uint16_t      site;  /* address of the JMP or JSRR */
+	uint8_t       next;  /* way replaced on the next miss */
+	uint16_t      target[IC_WAYS];
+	struct block *b[IC_WAYS];
+	uint64_t      gen;   /* link_gen the entries belong to */
+};
+
+struct inline_cache icache[IC_SIZE];
+
+/* times the interpreter reached each address that has no block yet */
+uint8_t heat[MEMORY_SIZE];
+
+void flush_cache()
+{
+	for (int page = 0; page < PAGE_COUNT; page++) {
+		for (struct block *b = page_blocks[page]; b; b = b->page_next) {
+			block_map[b->start] = NULL;
+		}
+		page_blocks[page] = NULL;
+	}
+	for (struct block *b = tier2_blocks; b; b = b->page_next) {
+		block_map[b->start] = NULL;
+	}
+	tier2_blocks = NULL;
+	memset(code_words, 0, sizeof(code_words));
+	memset(region_used, 0, sizeof(region_used));
+	region = 0;
+	cache_gen++;
+	link_gen++;
+	cache_flushed = 1;
+	cache_stats.flushes++;
+}
+
+void mark_code(const struct block *b)
+{
+	for (uint16_t a = b->start; a < b->end; a++) {
+		code_words[a / 32] |= (uint32_t) 1 << (a % 32);
+	}
+}
+
+/* go back to the baseline blocks, which start counting towards tier 2 again */
+void drop_tier2()
+{
+	for (struct block *b = tier2_blocks; b; b = b->page_next) {
+		if (block_map[b->start] == b) {
+			block_map[b->start] = b->base;
+		}
+		b->base->runs = 0;
+		b->base->taken = 0;
+		b->base->queued = 0;
+	}
+	tier2_blocks = NULL;
+}
+
+/*
+ * called for stores into code: drop the blocks translated from `address`
+ * and the optimized blocks, which may contain copies of them; their
+ * space in the arena is reclaimed when their region is evicted
+ */
+void invalidate_code(uint16_t address)
+{
+	int page = address / PAGE_WORDS;
+
+	drop_tier2();
+
+	for (struct block **p = &page_blocks[page]; *p; ) {
+		struct block *b = *p;
+		if (address >= b->start && address < b->end) {
+			*p = b->page_next;
+			if (block_map[b->start] == b) {
+				block_map[b->start] = NULL;
+			}
+		} else {
+			p = &b->page_next;
+		}
+	}
+
+	memset(code_words + page * PAGE_WORDS / 32, 0, PAGE_WORDS / 8);
+	for (struct block *b = page_blocks[page]; b; b = b->page_next) {
+		mark_code(b);
+	}
+
+	/* entries in the return address stack and the inline caches are stale */
+	cache_gen++;
+	link_gen++;
+	cache_flushed = 1;
+	cache_stats.invalidations++;
+}
+
+/*
+ * empty region `r` of the arena: unlink its blocks from the cache, and
+ * the optimized blocks, which may contain copies of them
+ */
+void evict_region(int r)
+{
+	unsigned char *lo = arena + (size_t) r * REGION_SIZE;
+	unsigned char *hi = lo + REGION_SIZE;
+
+	if (region_used[r] == 0) {
+		return;
+	}
+
+	drop_tier2();
+	memset(code_words, 0, sizeof(code_words));
+	for (int page = 0; page < PAGE_COUNT; page++) {
+		for (struct block **p = &page_blocks[page]; *p; ) {
+			struct block *b = *p;
+			if ((unsigned char *) b >= lo && (unsigned char *) b < hi) {
+				*p = b->page_next;
+				if (block_map[b->start] == b) {
+					block_map[b->start] = NULL;
+				}
+			} else {
+				mark_code(b);
+				p = &b->page_next;
+			}
+		}
+	}
+
+	region_used[r] = 0;
+	cache_gen++;
+	link_gen++;
+	cache_flushed = 1;
+	cache_stats.evictions++;
+}
+
+/* one line summary of the cache for --stats and the daemon's stats request */
+int format_cache_stats(char *buf, size_t size)
+{
+	size_t used = 0;
+	for (int r = 0; r < ARENA_REGIONS; r++) {
+		used += region_used[r];
+	}
+	uint64_t total = cache_stats.in_blocks + cache_stats.interpreted;
+
+	return snprintf(buf, size,
+	                "cache %zu/%d bytes, %llu blocks, %llu optimized, %llu evictions,"
+	                " %llu flushes, %llu invalidations, %.1f%% of instructions in blocks\n",
+	                used, ARENA_SIZE,
+	                (unsigned long long) cache_stats.translated,
+	                (unsigned long long) cache_stats.optimized,
+	                (unsigned long long) cache_stats.evictions,
+	                (unsigned long long) cache_stats.flushes,
+	                (unsigned long long) cache_stats.invalidations,
+	                total ? 100.0 * cache_stats.in_blocks / total : 0.0);
+}
+
+/* the blocks run most often, for --stats */
+void print_hot_blocks(FILE *out, int top)
+{
+	struct block *hot[16] = { NULL };
+	char start[48];
+
+	if (top > 16) {
+		top = 16;
+	}
+	for (int a = 0; a < MEMORY_SIZE; a++) {
+		struct block *b = block_map[a];
+		if (!b || b->start != a || (hot[top - 1] && b->runs <= hot[top - 1]->runs)) {
+			continue;
+		}
+		int i = top - 1;
+		for (; i > 0 && (!hot[i - 1] || hot[i - 1]->runs < b->runs); i--) {
+			hot[i] = hot[i - 1];
+		}
+		hot[i] = b;
+	}
+
+	for (int i = 0; i < top && hot[i]; i++) {
+		format_address(start, sizeof(start), hot[i]->start);
+		fprintf(out, "%12u runs  tier%d  %s-x%04X\n",
+		        hot[i]->runs, hot[i]->tier, start, hot[i]->end);
+	}
+}
+
+/*** Memory Access ***/
+void mem_write(uint16_t address, uint16_t value)
+{
+	written[address / 32] |= (uint32_t) 1 << (address % 32);
+	if (code_words[address / 32] & ((uint32_t) 1 << (address % 32))) {
+		invalidate_code(address);
+	}
+	memory[address] = value;
+}
+
+uint16_t mem_read(uint16_t address)
+{
+	if (address == MR_KBSR) {
+		if (check_key()) {
+			memory[MR_KBSR] = (1 << 15);
+			memory[MR_KBDR] = console_getc();
+		} else {
+			memory[MR_KBSR] = 0;
+			/* nothing to read, give the rest of the time slice away */
+			instr_count -= slice_left;
+			slice_left = 0;
+		}
+	}
+	return memory[address];
+}
+
+/*** UNIX Setting Up Terminal Input Buffering ***/
+struct termios original_tio;
+
+void disable_input_buffering()
+{
+	tcgetattr(STDIN_FILENO, &original_tio);
+	struct termios new_tio = original_tio;
+	new_tio.c_lflag &= ~ICANON & ~ECHO;
+	tcsetattr(STDIN_FILENO, TCSANOW, &new_tio);
+}
+
+void restore_input_buffering()
+{
+	tcsetattr(STDIN_FILENO, TCSANOW, &original_tio);
+}
+
+/* only flag it: the main loop shuts down once the slice is over */
+void handle_interrupt(int signal)
+{
+	(void) signal;
+	interrupted = 1;
+}
+
+/*** ADD ***/
+void op_ADD(uint16_t instr)
+{
+	/* destination register (DR) */
+	uint16_t  DR = (instr >> 9) & 0x7;
+	/* first operand (SR1) */
+	uint16_t SR1 = (instr >> 6) & 0x7;
+	/* whether we are in immediate mode */
+	uint16_t imm_flag = (instr >> 5) & 0x1;
+
+	if (imm_flag) {
+		uint16_t imm5 = sign_extend(instr & 0x1F, 5);
+		reg[DR] = reg[SR1] + imm5;
+	} else {
+		uint16_t SR2 = instr & 0x7;
+		reg[DR] = reg[SR1] + reg[SR2];
+	}
+
+	update_flags(DR);
+}
+
+/*** AND ***/
+void op_AND(uint16_t instr)
+{
+	/* destination register (DR) */
+	uint16_t  DR = (instr >> 9) & 0x7;
+	/* first operand (SR1) */
+	uint16_t SR1 = (instr >> 6) & 0x7;
+	/* whether we are in immediate mode */
+	uint16_t imm_flag = (instr >> 5) & 0x1;
+
+	if (imm_flag) {
+		uint16_t imm5 = sign_extend(instr & 0x1F, 5);
+		reg[DR] = reg[SR1] & imm5;
+	} else {
+		uint16_t SR2 = instr & 0x7;
+		reg[DR] = reg[SR1] & reg[SR2];
+	}
+
+	update_flags(DR);
+}
+
+/*** NOT ***/
+void op_NOT(uint16_t instr)
+{
+	/* destination register (DR) */
+	uint16_t DR = (instr >> 9) & 0x7;
+	/* source register (SR) */
+	uint16_t SR = (instr >> 6) & 0x7;
+
+	reg[DR] = ~reg[SR];
+
+	update_flags(DR);
+}
+
+/*** BR ***/
+void op_BR(uint16_t instr)
+{
+	/* PCoffset9 */
+	uint16_t PC_offset = sign_extend(instr & 0x1ff, 9);
+	/* conditional flags */
+	uint16_t cond_flag = (instr >> 9) & 0x7;
+
+	if (cond_flag & reg[R_COND]) {
+		reg[R_PC] += PC_offset;
+	}	
+}
+
+/*** JMP ***/
+void op_JMP(uint16_t instr)
+{
+	/* base register */
+	uint16_t BaseR = (instr >> 6) & 0x7;
+
+	reg[R_PC] = reg[BaseR];
+}
+
+/*** JSR ***/
+void op_JSR(uint16_t instr)
+{
+	reg[R_R7] = reg[R_PC];
+
+/*JSR*/ if ((instr >> 11) & 1) {
+		/* PCoffset11 */
+		uint16_t PC_offset = sign_extend(instr & 0x7ff, 11);
+		reg[R_PC] += PC_offset;
+/*JSRR*/} else {
+		/* base register */
+		uint16_t BaseR = (instr >> 6) & 0x7;
+		reg[R_PC] = reg[BaseR];
+	}
+}
+
+/*** LD ***/
+void op_LD(uint16_t instr)
+{
+	/* destination register (DR) */
+	uint16_t DR = (instr >> 9) & 0x7;
+	/* PCoffset9 */
+	uint16_t PC_offset = sign_extend(instr & 0x1ff, 9);
+
+	/* add pc_offset to the current PC, look at that memory location to get the final value */
+	reg[DR] = mem_read(reg[R_PC] + PC_offset);
+
+	update_flags(DR);
+}
+
+/*** LDI ***/
+void op_LDI(uint16_t instr)
+{
+	/* destination register (DR) */
+	uint16_t DR = (instr >> 9) & 0x7;
+	/* PCoffset9 */
+	uint16_t PC_offset = sign_extend(instr & 0x1ff, 9);
+
+	/* add pc_offset to the current PC, look at that memory location to get the final address */
+	reg[DR] = mem_read(mem_read(reg[R_PC] + PC_offset));
+
+	update_flags(DR);
+}
+
+/*** LDR ***/
+void op_LDR(uint16_t instr)
+{
+	/* destination register (DR) */
+	uint16_t     DR = (instr >> 9) & 0x7;
+	/* base register (BaseR) */
+	uint16_t  BaseR = (instr >> 6) & 0x7;
+	/* offset6 */
+	uint16_t offset = sign_extend(instr & 0x3f, 6);
+
+	/* add offset to the value of base register, look at that memory location to get the final value */
+	reg[DR] = mem_read(reg[BaseR] + offset);
+
+	update_flags(DR);
+}
+
+/*** LEA ***/
+void op_LEA(uint16_t instr)
+{
+	/* destination register (DR) */
+	uint16_t DR = (instr >> 9) & 0x7;
+	/* PCoffset9 */
+	uint16_t PC_offset = sign_extend(instr & 0x1ff, 9);
+
+	/* add pc_offset to the current PC, and load this address into destination register */
+	reg[DR] = reg[R_PC] + PC_offset;
+
+	update_flags(DR);
+}
+
+/*** ST ***/
+void op_ST(uint16_t instr)
+{
+	/* source register */
+	uint16_t SR = (instr >> 9) & 0x7;
+	/* PCoffset9 */
+	uint16_t PC_offset = sign_extend(instr & 0x1ff, 9);
+
+	mem_write(reg[R_PC] + PC_offset, reg[SR]);
+}
+
+/*** STI ***/
+void op_STI(uint16_t instr)
+{
+	/* source register */
+	uint16_t SR = (instr >> 9) & 0x7;
+	/* PCoffset9 */
+	uint16_t PC_offset = sign_extend(instr & 0x1ff, 9);
+
+	mem_write(mem_read(reg[R_PC] + PC_offset), reg[SR]);
+}
+
+/*** STR ***/
+void op_STR(uint16_t instr)
+{
+	/* source register */
+	uint16_t    SR = (instr >> 9) & 0x7;
+	/* base register */
+	uint16_t BaseR = (instr >> 6) & 0x7;
 	/* offset6 */
 	uint16_t offset = sign_extend(instr & 0x3f, 6);
 
-	/* add offset to the value of base register, look at that memory location to get the final value */
-	reg[DR] = mem_read(reg[BaseR] + offset);
+	mem_write(reg[BaseR] + offset, reg[SR]);
+}
+
+/*** TRAP ***/
+void op_TRAP(uint16_t instr)
+{
+	/* trapvect8 */
+	uint16_t trap_vect = sign_extend(instr & 0xff, 8);
+
+	reg[R_R7] = reg[R_PC];
+	reg[R_PC] = mem_read(trap_vect);
+}
+
+
+/*** TRAP_GETC ***/
+/* returns 0 if no key is available yet and the trap has to be retried */
+int trap_GETC()
+{
+	if (!check_key()) {
+		return 0;
+	}
+
+	reg[R_R0] = (uint16_t) console_getc();
+	return 1;
+}
+
+/*** TRAP_OUT ***/
+void trap_OUT()
+{
+	console_putc((char) reg[R_R0]);
+}
+
+/*** TRAP_PUTS ***/
+void trap_PUTS()
+{
+	/* one char per word */
+	uint16_t *c = memory + reg[R_R0];
+
+	while (*c) {
+		console_putc((char) *c);
+		c++;
+	}
+}
+
+/*** TRAP_IN ***/
+/* returns 0 if no key is available yet and the trap has to be retried */
+int trap_IN()
+{
+	char c;
+
+	/* the prompt is printed only once, even if the trap is retried */
+	if (!in_prompted) {
+		console_puts("Enter a character: ");
+		in_prompted = 1;
+	}
+
+	if (!check_key()) {
+		return 0;
+	}
+
+	in_prompted = 0;
+	c = console_getc();
+
+	reg[R_R0] = (uint16_t) c;
+	console_putc(c);
+	return 1;
+}
+
+/*** TRAP_PUTSP ***/
+void trap_PUTSP()
+{
+	/* two characters per word */
+	uint16_t *c = memory + reg[R_R0];
+
+	while (*c) {
+		/* first character is bits[7:0] */
+		console_putc((char) (*c & 0xff));
+
+		if ((*c >> 8) == 0)
+			break;
+
+		/* second character is bits[15:8] */
+		console_putc((char) ((*c >> 8 ) & 0xff));
+		c++;
+	}
+}
+
+/*** TRAP_HALT ***/
+void trap_HALT()
+{
+	console_puts("HALT\n");
+	console_flush();
+}
+
+/* run the trap `instr` for either interpreter; returns VM_CONTINUE unless it ends the slice */
+int run_trap(uint16_t instr)
+{
+	switch (instr & 0xFF) {
+	case TRAP_GETC:
+		if (!trap_GETC()) {
+			/* re-execute the trap once a key arrives */
+			reg[R_PC]--;
+			instr_count -= slice_left + 1;
+			slice_left = 0;
+			return VM_BLOCKED;
+		}
+		break;
+	case TRAP_OUT:
+		trap_OUT();
+		break;
+	case TRAP_PUTS:
+		trap_PUTS();
+		break;
+	case TRAP_IN:
+		if (!trap_IN()) {
+			reg[R_PC]--;
+			instr_count -= slice_left + 1;
+			slice_left = 0;
+			return VM_BLOCKED;
+		}
+		break;
+	case TRAP_PUTSP:
+		trap_PUTSP();
+		break;
+	case TRAP_HALT:
+		trap_HALT();
+		instr_count -= slice_left;
+		slice_left = 0;
+		return VM_HALTED;
+	}
+	return VM_CONTINUE;
+}
+
+/*** Translator ***/
+struct block *alloc_block(int ops)
+{
+	/* keep the blocks pointer aligned */
+	size_t size = sizeof(struct block) + ops * sizeof(struct uop);
+	size = (size + sizeof(void *) - 1) & ~(sizeof(void *) - 1);
+
+	if (region_used[region] + size > REGION_SIZE) {
+		region = (region + 1) % ARENA_REGIONS;
+		evict_region(region);
+	}
+
+	struct block *b = (struct block *) (arena + (size_t) region * REGION_SIZE + region_used[region]);
+	region_used[region] += size;
+	return b;
+}
+
+/* enter a block into the cache */
+void install_block(struct block *b)
+{
+	int page = b->start / PAGE_WORDS;
+
+	mark_code(b);
+	cache_stats.translated++;
+	b->page_next = page_blocks[page];
+	page_blocks[page] = b;
+	block_map[b->start] = b;
+}
+
+/*
+ * translation is table driven: each instruction becomes a copy of its
+ * opcode's stencil, a micro-op with a hole that is patched with the
+ * instruction's immediate or the address it refers to. The register
+ * fields are in the same place in every instruction and are copied as
+ * they are.
+ */
+enum
+{
+	HOLE_NONE = 0,
+	HOLE_IMM5,     /* sign extended imm5                  */
+	HOLE_OFFSET6,  /* sign extended offset6               */
+	HOLE_PC9,      /* PC + sign extended PCoffset9        */
+	HOLE_PC11      /* PC + sign extended PCoffset11       */
+};
+
+struct stencil
+{
+	uint8_t op;    /* U_*, U_EXIT leaves the instruction to the interpreter */
+	uint8_t hole;  /* HOLE_* */
+};
+
+/* by opcode and mode bit, the mode bit selects ADD/AND immediate and JSR */
+const struct stencil stencils[16][2] =
+{
+	[OP_BR]   = { { U_BR,   HOLE_PC9 },     { U_BR,   HOLE_PC9 } },
+	[OP_ADD]  = { { U_ADD,  HOLE_NONE },    { U_ADDI, HOLE_IMM5 } },
+	[OP_LD]   = { { U_LD,   HOLE_PC9 },     { U_LD,   HOLE_PC9 } },
+	[OP_ST]   = { { U_ST,   HOLE_PC9 },     { U_ST,   HOLE_PC9 } },
+	[OP_JSR]  = { { U_JSRR, HOLE_NONE },    { U_JSR,  HOLE_PC11 } },
+	[OP_AND]  = { { U_AND,  HOLE_NONE },    { U_ANDI, HOLE_IMM5 } },
+	[OP_LDR]  = { { U_LDR,  HOLE_OFFSET6 }, { U_LDR,  HOLE_OFFSET6 } },
+	[OP_STR]  = { { U_STR,  HOLE_OFFSET6 }, { U_STR,  HOLE_OFFSET6 } },
+	[OP_RTI]  = { { U_EXIT, HOLE_NONE },    { U_EXIT, HOLE_NONE } },
+	[OP_NOT]  = { { U_NOT,  HOLE_NONE },    { U_NOT,  HOLE_NONE } },
+	[OP_LDI]  = { { U_LDI,  HOLE_PC9 },     { U_LDI,  HOLE_PC9 } },
+	[OP_STI]  = { { U_STI,  HOLE_PC9 },     { U_STI,  HOLE_PC9 } },
+	[OP_JMP]  = { { U_JMP,  HOLE_NONE },    { U_JMP,  HOLE_NONE } },
+	[OP_RES]  = { { U_EXIT, HOLE_NONE },    { U_EXIT, HOLE_NONE } },
+	[OP_LEA]  = { { U_LEA,  HOLE_PC9 },     { U_LEA,  HOLE_PC9 } },
+	[OP_TRAP] = { { U_EXIT, HOLE_NONE },    { U_EXIT, HOLE_NONE } }
+};
+
+int mode_bit(uint16_t instr)
+{
+	return (instr >> 12) == OP_JSR ? (instr >> 11) & 1 : (instr >> 5) & 1;
+}
+
+/* `pc` is the incremented PC the offsets are relative to */
+uint16_t patch_hole(int hole, uint16_t instr, uint16_t pc)
+{
+	switch (hole) {
+	case HOLE_IMM5:
+		return sign_extend(instr & 0x1F, 5);
+	case HOLE_OFFSET6:
+		return sign_extend(instr & 0x3f, 6);
+	case HOLE_PC9:
+		return pc + sign_extend(instr & 0x1ff, 9);
+	case HOLE_PC11:
+		return pc + sign_extend(instr & 0x7ff, 11);
+	}
+	return 0;
+}
+
+/*
+ * superinstructions: replace the instruction sequences --profile-ops
+ * finds most often in loops by single micro-ops, in place, returns the
+ * new number of micro-ops
+ */
+int fuse(struct uop *ops, int len)
+{
+	int out = 0;
+
+	for (int i = 0; i < len; i++) {
+		struct uop *a = &ops[i];
+		struct uop *b = &ops[i + 1];
+		struct uop *c = &ops[i + 2];
+		struct uop f = *a;
+
+		if (i + 1 < len && a->op == U_ADDI && b->op == U_BR) {
+			/* the loop counter: ADD R, R, #-1; BRp loop */
+			f.op = U_ADDI_BR;
+			f.aux = (int8_t) a->imm;
+			f.sr2 = b->dr;
+			f.imm = b->imm;
+		} else if (i + 1 < len && a->op == U_ANDI && a->imm == 0 && b->op == U_ADDI
+		           && b->dr == a->dr && b->sr1 == a->dr) {
+			/* AND R, R, #0; ADD R, R, #k loads a constant */
+			f.op = U_SETI;
+			f.imm = b->imm;
+		} else if (i + 2 < len && b->op == U_ADDI && b->dr == a->dr && b->sr1 == a->dr
+		           && c->dr == a->dr && c->imm == a->imm
+		           && ((a->op == U_LD && c->op == U_ST)
+		               || (a->op == U_LDR && c->op == U_STR && c->sr1 == a->sr1 && a->sr1 != a->dr))) {
+			/* incrementing a variable in memory */
+			f.op = a->op == U_LD ? U_LD_ADDI_ST : U_LDR_ADDI_STR;
+			f.aux = (int8_t) b->imm;
+		} else {
+			ops[out++] = f;
+			continue;
+		}
+
+		f.flags = UF_CC;
+		i += uop_width(f.op) - 1;
+		f.n = ops[i].n;
+		ops[out++] = f;
+	}
+	return out;
+}
+
+/* translate the block starting at `start` and enter it into the cache */
+struct block *translate(uint16_t start)
+{
+	struct uop ops[BLOCK_MAX_OPS];
+	int page = start / PAGE_WORDS;
+	uint16_t pc = start;
+	int count = 0;
+	int len = 0;
+
+	while (!len) {
+		struct uop *u = &ops[count];
+		uint16_t instr = memory[pc];
+
+		/* clear every field and the padding too, the ops are saved as bytes */
+		memset(u, 0, sizeof(*u));
+		u->pc = pc;
+		u->dr  = (instr >> 9) & 0x7;
+		u->sr1 = (instr >> 6) & 0x7;
+		u->sr2 = instr & 0x7;
+		u->n = count + 1;
+
+		/*
+		 * devices, traps and page crossings are left to the interpreter;
+		 * the final slot is kept for the U_EXIT
+		 */
+		if (pc >= MR_KBSR || pc / PAGE_WORDS != page || count == BLOCK_MAX_OPS - 1) {
+			u->op = U_EXIT;
+			u->imm = pc;
+			u->n = count;
+			len = count + 1;
+			break;
+		}
+
+		/* copy the stencil, then fill in its hole */
+		const struct stencil *st = &stencils[instr >> 12][mode_bit(instr)];
+		u->op = st->op;
+		if (u->op == U_EXIT) {
+			/* TRAP, RTI and RES */
+			u->imm = pc;
+			u->n = count;
+			len = count + 1;
+			continue;
+		}
+		if (u->op == U_JMP && u->sr1 == R_R7) {
+			u->op = U_RET;
+		}
+		u->imm = patch_hole(st->hole, instr, ++pc);
+		if (u->op >= U_BR) {
+			len = count + 1;
+		}
+		if (u->op <= U_LEA) {
+			u->flags = UF_CC;
+		}
+		count++;
+	}
+	len = fuse(ops, len);
+
+	for (uint16_t a = start; a < pc; a++) {
+		if (written[a / 32] & ((uint32_t) 1 << (a % 32))) {
+			/* the code is not the loaded image anymore */
+			cache_image_hash = 0;
+		}
+	}
+
+	struct block *b = alloc_block(len);
+	b->start = start;
+	b->end = pc;
+	b->count = count;
+	b->len = len;
+	b->runs = 0;
+	b->taken = 0;
+	b->tier = 1;
+	b->base = NULL;
+	b->queued = 0;
+	memcpy(b->ops, ops, len * sizeof(struct uop));
+
+	install_block(b);
+	return b;
+}
+
+/* translate everything statically reachable from `entry` ahead of time */
+void translate_image(uint16_t entry)
+{
+	static uint16_t work[MEMORY_SIZE];
+	int n = 0;
+
+	if (interpreter != INTERP_TIERED) {
+		return;
+	}
+	work[n++] = entry;
+	while (n > 0) {
+		uint16_t pc = work[--n];
+
+		/* only follow the code into pages that hold image data */
+		if (block_map[pc] || pc >= MR_KBSR
+		    || !(loaded_pages & ((uint32_t) 1 << (pc / PAGE_WORDS)))) {
+			continue;
+		}
+
+		cache_flushed = 0;
+		struct block *b = translate(pc);
+		struct uop *last = &b->ops[b->len - 1];
+
+		/* stop once the image does not fit into the arena */
+		if (cache_flushed || n + 2 > MEMORY_SIZE) {
+			break;
+		}
+		if (last->op == U_EXIT) {
+			/* the interpreter runs traps, then carries on after them */
+			uint16_t instr = memory[last->imm];
+			if (instr >> 12 != OP_TRAP) {
+				work[n++] = last->imm;
+			} else if ((instr & 0xFF) != TRAP_HALT) {
+				work[n++] = last->imm + 1;
+			}
+			continue;
+		}
+		if (last->op == U_BR || last->op == U_ADDI_BR || last->op == U_JSR) {
+			work[n++] = last->imm;
+		}
+		if (last->op != U_JMP && last->op != U_RET) {
+			work[n++] = b->end;
+		}
+	}
+}
+
+void ras_push(uint16_t address)
+{
+	struct ras_entry *e = &ras[ras_top++ % RAS_SIZE];
+
+	e->pc = address;
+	e->b = block_map[address];
+	e->gen = link_gen;
+}
+
+/* the block an indirect jump from `site` to `target` continues in, if any */
+struct block *ic_lookup(uint16_t site, uint16_t target)
+{
+	struct inline_cache *c = &icache[site % IC_SIZE];
+
+	if (c->site != site || c->gen != link_gen) {
+		memset(c, 0, sizeof(*c));
+		c->site = site;
+		c->gen = link_gen;
+	}
+	for (int i = 0; i < IC_WAYS; i++) {
+		if (c->target[i] == target && c->b[i]) {
+			return c->b[i];
+		}
+	}
+
+	struct block *b = block_map[target];
+	if (b) {
+		c->target[c->next] = target;
+		c->b[c->next] = b;
+		c->next = (c->next + 1) % IC_WAYS;
+	}
+	return b;
+}
+
+/*
+ * called when the run count of `b` wraps: it is set back to half of 2^32 and
+ * the taken count is halved with it, so the branch profile keeps its ratio
+ * and never claims more taken branches than runs, in memory or in a .lc3t
+ */
+void halve_profile(struct block *b)
+{
+	b->runs = UINT32_C(1) << 31;
+	b->taken /= 2;
+}
+
+int back_edge;  /* exec_block() left on a taken branch to its own address or below */
+
+/*
+ * run a translated block, and the blocks indirect jumps chain into, returns the
+ * number of instructions of the last one left unexecuted
+ *
+ * R0-R7 are kept in a local copy, which stores into guest memory cannot
+ * alias, so they are not reloaded after every store; the micro-ops index
+ * it by register number, so it stays on the stack, and only PC and COND
+ * live in host registers. The copy is written back to reg[] only when
+ * control leaves for run_vm().
+ */
+
+int exec_block(struct block *b)
+{
+	struct ras_entry *e;
+	struct block *next;
+	struct uop *u;
+	uint16_t r[R_PC];  /* R0 to R7 */
+	uint16_t pc;
+	uint16_t cond = reg[R_COND];
+	int left = 0;
+
+	memcpy(r, reg, sizeof(r));
+	cache_flushed = 0;
+	back_edge = 0;
+
+	for (u = b->ops; ; u++) {
+		switch (u->op) {
+		case U_ADD:
+			r[u->dr] = r[u->sr1] + r[u->sr2];
+			break;
+		case U_ADDI:
+			r[u->dr] = r[u->sr1] + u->imm;
+			break;
+		case U_AND:
+			r[u->dr] = r[u->sr1] & r[u->sr2];
+			break;
+		case U_ANDI:
+			r[u->dr] = r[u->sr1] & u->imm;
+			break;
+		case U_NOT:
+			r[u->dr] = ~r[u->sr1];
+			break;
+		case U_LD:
+			r[u->dr] = mem_read(u->imm);
+			break;
+		case U_LDI:
+			r[u->dr] = mem_read(mem_read(u->imm));
+			break;
+		case U_LDR:
+			r[u->dr] = mem_read(r[u->sr1] + u->imm);
+			break;
+		case U_LEA:
+		case U_SETI:
+			r[u->dr] = u->imm;
+			break;
+		case U_ST:
+			mem_write(u->imm, r[u->dr]);
+			goto stored;
+		case U_STI:
+			mem_write(mem_read(u->imm), r[u->dr]);
+			goto stored;
+		case U_STR:
+			mem_write(r[u->sr1] + u->imm, r[u->dr]);
+			goto stored;
+		case U_LD_ADDI_ST:
+			r[u->dr] = mem_read(u->imm) + u->aux;
+			cond = flags_of(r[u->dr]);
+			mem_write(u->imm, r[u->dr]);
+			goto stored;
+		case U_LDR_ADDI_STR:
+			r[u->dr] = mem_read(r[u->sr1] + u->imm) + u->aux;
+			cond = flags_of(r[u->dr]);
+			mem_write(r[u->sr1] + u->imm, r[u->dr]);
+			goto stored;
+		case U_GUARD:
+			/* the block only goes on the way the branch usually went */
+			if (!(cond & u->dr) != !(u->flags & UF_TAKEN)) {
+				pc = u->imm;
+				left = b->count - u->n;
+				back_edge = !(u->flags & UF_TAKEN) && pc <= u->pc;
+				goto leave;
+			}
+			break;
+		case U_BR:
+			pc = u->pc + 1;
+			if (cond & u->dr) {
+				pc = u->imm;
+				b->taken++;
+				back_edge = pc <= u->pc;
+			}
+			goto leave;
+		case U_ADDI_BR:
+			r[u->dr] = r[u->sr1] + u->aux;
+			cond = flags_of(r[u->dr]);
+			pc = u->pc + 2;
+			if (cond & u->sr2) {
+				pc = u->imm;
+				b->taken++;
+				back_edge = pc <= u->pc + 1;
+			}
+			goto leave;
+		case U_JMP:
+			pc = r[u->sr1];
+			next = ic_lookup(u->pc, pc);
+			goto chain;
+		case U_RET:
+			pc = r[R_R7];
+			e = &ras[--ras_top % RAS_SIZE];
+			if (e->pc != pc || e->gen != link_gen) {
+				goto leave;
+			}
+			next = e->b;
+			goto chain;
+		case U_JSR:
+			r[R_R7] = u->pc + 1;
+			pc = u->imm;
+			ras_push(u->pc + 1);
+			goto leave;
+		case U_JSRR:
+			/* like op_JSR, R7 is written before the base register is read */
+			r[R_R7] = u->pc + 1;
+			pc = r[u->sr1];
+			ras_push(u->pc + 1);
+			next = ic_lookup(u->pc, pc);
+			goto chain;
+		case U_EXIT:
+			pc = u->imm;
+			goto leave;
+		}
+		if (u->flags & UF_CC) {
+			cond = flags_of(r[u->dr]);
+		}
+		continue;
+
+	chain:
+		/* the next block is charged to the time slice here */
+		if (!next || next->count > slice_left) {
+			goto leave;
+		}
+		b = next;
+		if (++b->runs == 0) {
+			halve_profile(b);
+		}
+		slice_left -= b->count;
+		cache_stats.in_blocks += b->count;
+		u = b->ops - 1;
+		continue;
+
+	stored:
+		if (cache_flushed) {
+			/* the block overwrote itself, continue in the interpreter */
+			pc = u->pc + uop_width(u->op);
+			left = b->count - u->n;
+			goto leave;
+		}
+	}
+
+leave:
+	memcpy(reg, r, sizeof(r));
+	reg[R_PC] = pc;
+	reg[R_COND] = cond;
+	return left;
+}
+
+/*** Compile Thread ***/
+/*
+ * hot blocks are copied, together with the blocks they unconditionally
+ * branch to, into a compile_job; the compile thread optimizes the copy
+ * and hands it back, and run_vm() installs the result between time
+ * slices unless the cache was flushed in the meantime.
+ */
+enum { COMPILE_QUEUE = 64, TIER2_MAX_SEGMENTS = 4, INLINE_MAX_OPS = 16 };
+
+struct compile_job
+{
+	uint64_t   gen;    /* cache_gen when the job was queued */
+	uint16_t   start;
+	uint16_t   end;
+	uint16_t   count;
+	uint16_t   len;
+	uint32_t   runs;
+	struct uop ops[TIER2_MAX_OPS];
+};
+
+struct compile_job *compile_pending[COMPILE_QUEUE];
+struct compile_job *compile_done[COMPILE_QUEUE];
+int                 pending_count, done_count;
+int                 compiler_state;  /* 0 not started, 1 running, -1 unavailable */
+pthread_t           compiler_thread;
+pthread_mutex_t     compile_lock = PTHREAD_MUTEX_INITIALIZER;
+pthread_cond_t      compile_wake = PTHREAD_COND_INITIALIZER;
+
+/* does an exit branch go to imm no matter what the condition codes are */
+int unconditional(const struct uop *u)
+{
+	return u->op == U_BR && (u->dr == 0x7 || u->dr == 0);
+}
+
+/*
+ * tier 2: drop the branches between the copied blocks, then drop the
+ * condition code updates that are overwritten before anything reads them
+ */
+void optimize(struct compile_job *job)
+{
+	int n = 0;
+	int len = 0;
+
+	for (int i = 0; i < job->len; i++) {
+		struct uop u = job->ops[i];
+
+		n += uop_width(u.op);
+		if (i + 1 < job->len && unconditional(&u)) {
+			continue;
+		}
+		u.n = n;
+		job->ops[len++] = u;
+	}
+	job->len = len;
+	job->count = n;
+
+	/*
+	 * the exit and stores (which may leave the block early) need the
+	 * condition codes to be up to date
+	 */
+	int live = 1;
+	for (int i = len - 1; i >= 0; i--) {
+		struct uop *u = &job->ops[i];
+
+		if (u->op >= U_ST) {
+			live = 1;
+		} else if (u->flags & UF_CC) {
+			if (!live) {
+				u->flags &= ~UF_CC;
+			}
+			live = 0;
+		}
+	}
+}
+
+void *compiler_main(void *arg)
+{
+	(void) arg;
+
+	block_interrupt();
+
+	pthread_mutex_lock(&compile_lock);
+	for (;;) {
+		while (pending_count == 0) {
+			pthread_cond_wait(&compile_wake, &compile_lock);
+		}
+		struct compile_job *job = compile_pending[--pending_count];
+		pthread_mutex_unlock(&compile_lock);
+
+		optimize(job);
+
+		pthread_mutex_lock(&compile_lock);
+		if (done_count < COMPILE_QUEUE) {
+			compile_done[done_count] = job;
+			__atomic_store_n(&done_count, done_count + 1, __ATOMIC_RELAXED);
+		} else {
+			free(job);
+		}
+	}
+	return NULL;
+}
+
+/*
+ * can a JSR to `callee` be inlined: a short baseline block that returns
+ * and leaves R7 alone, so the RET goes back to the call site
+ */
+int inlinable(const struct block *callee)
+{
+	if (!callee || callee->tier != 1 || callee->len > INLINE_MAX_OPS
+	    || callee->ops[callee->len - 1].op != U_RET) {
+		return 0;
+	}
+	for (int i = 0; i < callee->len - 1; i++) {
+		if (writes_dr(callee->ops[i].op) && callee->ops[i].dr == R_R7) {
+			return 0;
+		}
+	}
+	return 1;
+}
+
+enum { BIAS_MIN_RUNS = 64 };
+
+/*
+ * which way the branch ending `b` usually goes: 1 taken, 0 not taken,
+ * -1 if it has no such habit (taken or not taken 90% of the time)
+ */
+int likely_way(const struct block *b)
+{
+	const struct uop *last = &b->ops[b->len - 1];
+
+	if ((last->op != U_BR && last->op != U_ADDI_BR) || b->runs < BIAS_MIN_RUNS) {
+		return -1;
+	}
+	if ((uint64_t) b->taken * 10 >= (uint64_t) b->runs * 9) {
+		return 1;
+	}
+	if ((uint64_t) b->taken * 10 <= b->runs) {
+		return 0;
+	}
+	return -1;
+}
+
+/*
+ * copy a hot block and its likely successors for the compile thread,
+ * inlining the leaf subroutines they call. Conditional branches that
+ * usually go one way become guards, so the likely path runs straight
+ * through the optimized block and the unlikely one leaves it.
+ */
+void queue_block(struct block *b)
+{
+	struct compile_job *job;
+
+	b->queued = 1;
+	if (compiler_state == 0) {
+		compiler_state = pthread_create(&compiler_thread, NULL, compiler_main, NULL) == 0 ? 1 : -1;
+	}
+	if (compiler_state < 0 || !(job = malloc(sizeof(*job)))) {
+		return;
+	}
+
+	job->gen = cache_gen;
+	job->start = b->start;
+	job->end = b->end;
+	job->runs = b->runs;
+	job->len = 0;
+
+	struct block *seg = b;
+	int inlined = 0;
+	int cc_set = 0;
+	uint16_t ret = 0;
+	for (int segments = 0; segments < TIER2_MAX_SEGMENTS; segments++) {
+		struct block *cur = seg;
+		if (job->len + seg->len > TIER2_MAX_OPS) {
+			break;
+		}
+		memcpy(job->ops + job->len, seg->ops, seg->len * sizeof(struct uop));
+		job->len += seg->len;
+
+		struct uop *last = &job->ops[job->len - 1];
+		for (struct uop *u = job->ops + job->len - seg->len; u < last; u++) {
+			cc_set |= u->flags & UF_CC;
+		}
+		if (inlined) {
+			/*
+			 * the callee's RET goes back to the call site: a branch that
+			 * is never taken and falls through to the return address
+			 */
+			last->op = U_BR;
+			last->dr = 0;
+			last->pc = ret - 1;
+			last->imm = ret;
+			inlined = 0;
+		} else if (last->op == U_JSR && segments + 1 < TIER2_MAX_SEGMENTS
+		           && inlinable(block_map[last->imm])
+		           && job->len + block_map[last->imm]->len <= TIER2_MAX_OPS) {
+			/*
+			 * the JSR only sets R7, the callee follows; its baseline block
+			 * stays on the page lists, so storing into it drops this one
+			 */
+			ret = last->pc + 1;
+			seg = block_map[last->imm];
+			last->op = U_LEA;
+			last->dr = R_R7;
+			last->imm = ret;
+			last->flags = 0;
+			inlined = 1;
+			continue;
+		}
+
+		int way = unconditional(last) ? -1 : likely_way(cur);
+		if (way >= 0) {
+			uint16_t fall = last->pc + uop_width(last->op);
+			int split = last->op == U_ADDI_BR;
+
+			seg = block_map[way ? last->imm : fall];
+			if (!seg || seg->tier != 1 || seg->count == 0 || seg == b
+			    || segments + 1 == TIER2_MAX_SEGMENTS || job->len + split + seg->len > TIER2_MAX_OPS) {
+				break;
+			}
+			if (split) {
+				/* ADD, then the guard in place of the BR */
+				last[1] = last[0];
+				last->op = U_ADDI;
+				last->imm = (uint16_t) (int16_t) last->aux;
+				last->aux = 0;
+				last->flags = UF_CC;
+				last++;
+				last->dr = last->sr2;
+				last->pc++;
+				job->len++;
+			}
+			last->op = U_GUARD;
+			last->flags = way ? UF_TAKEN : 0;
+			last->imm = way ? fall : last->imm;
+			continue;
+		}
+
+		/*
+		 * follow the branch if its target is a baseline block of its own;
+		 * BRnzp is only taken once some instruction set the condition codes
+		 */
+		if (!unconditional(last) || (last->dr && !cc_set)) {
+			break;
+		}
+		seg = block_map[last->dr ? last->imm : (uint16_t) (last->pc + 1)];
+		if (!seg || seg->tier != 1 || seg->count == 0 || seg == b) {
+			break;
+		}
+	}
+
+	pthread_mutex_lock(&compile_lock);
+	if (pending_count < COMPILE_QUEUE) {
+		compile_pending[pending_count++] = job;
+		pthread_cond_signal(&compile_wake);
+		job = NULL;
+	}
+	pthread_mutex_unlock(&compile_lock);
+	free(job);
+}
+
+/* install what the compile thread finished, called between time slices and on loop back edges */
+void install_compiled()
+{
+	struct compile_job *done[COMPILE_QUEUE];
+	int count;
+
+	if (__atomic_load_n(&done_count, __ATOMIC_RELAXED) == 0) {
+		return;
+	}
+
+	pthread_mutex_lock(&compile_lock);
+	count = done_count;
+	memcpy(done, compile_done, count * sizeof(done[0]));
+	__atomic_store_n(&done_count, 0, __ATOMIC_RELAXED);
+	pthread_mutex_unlock(&compile_lock);
+
+	for (int i = 0; i < count; i++) {
+		struct compile_job *job = done[i];
+		struct block *old = block_map[job->start];
+
+		/* the blocks the job was made from are gone */
+		if (job->gen == cache_gen && old && old->tier == 1) {
+			cache_flushed = 0;
+			struct block *b = alloc_block(job->len);
+			if (!cache_flushed) {
+				b->start = job->start;
+				b->end = job->end;
+				b->count = job->count;
+				b->len = job->len;
+				b->runs = job->runs;
+				b->taken = 0;
+				b->tier = 2;
+				b->queued = 1;
+				b->base = old;
+				b->page_next = tier2_blocks;
+				tier2_blocks = b;
+				memcpy(b->ops, job->ops, job->len * sizeof(struct uop));
+				block_map[b->start] = b;
+				/* calls and indirect jumps must find it instead of the baseline block */
+				link_gen++;
+				cache_stats.optimized++;
+			}
+		}
+		free(job);
+	}
+}
+
+/*** Opcode Profile ***/
+/*
+ * --profile-ops runs the program in the interpreter only and counts the
+ * pairs and triples of instructions executed one after the other, to
+ * find the sequences worth fusing into one micro-op (see fuse())
+ */
+enum
+{
+	OPC_ADDI = 16,  /* opcodes 0-15, then the variants worth telling apart */
+	OPC_ANDI,
+	OPC_JSRR,
+	OPC_RET,
+	OPC_COUNT
+};
+
+const char *const opc_names[OPC_COUNT] =
+{
+	"BR", "ADD", "LD", "ST", "JSR", "AND", "LDR", "STR",
+	"RTI", "NOT", "LDI", "STI", "JMP", "RES", "LEA", "TRAP",
+	"ADD#", "AND#", "JSRR", "RET"
+};
+
+uint64_t *op_pairs;    /* [OPC_COUNT][OPC_COUNT], NULL unless profiling */
+uint64_t *op_triples;  /* [OPC_COUNT][OPC_COUNT][OPC_COUNT] */
+int       op_last[2];  /* the two instructions before */
+
+int opc(uint16_t instr)
+{
+	int op = instr >> 12;
+
+	if ((op == OP_ADD || op == OP_AND) && ((instr >> 5) & 1)) {
+		return op == OP_ADD ? OPC_ADDI : OPC_ANDI;
+	}
+	if (op == OP_JSR && !((instr >> 11) & 1)) {
+		return OPC_JSRR;
+	}
+	if (op == OP_JMP && ((instr >> 6) & 0x7) == R_R7) {
+		return OPC_RET;
+	}
+	return op;
+}
+
+int start_profile()
+{
+	op_pairs = calloc(OPC_COUNT * OPC_COUNT, sizeof(uint64_t));
+	op_triples = calloc(OPC_COUNT * OPC_COUNT * OPC_COUNT, sizeof(uint64_t));
+	op_last[0] = op_last[1] = -1;
+	return op_pairs && op_triples;
+}
+
+void profile_op(uint16_t instr)
+{
+	int op = opc(instr);
+
+	if (op_last[1] >= 0) {
+		op_pairs[op_last[1] * OPC_COUNT + op]++;
+		if (op_last[0] >= 0) {
+			op_triples[(op_last[0] * OPC_COUNT + op_last[1]) * OPC_COUNT + op]++;
+		}
+	}
+	op_last[0] = op_last[1];
+	op_last[1] = op;
+}
+
+/* the `top` most frequent of `n` counts, as "A B  count  percent" lines */
+void print_profile(const char *title, const uint64_t *counts, int n, int len, int top)
+{
+	uint64_t total = 0;
+	for (int i = 0; i < n; i++) {
+		total += counts[i];
+	}
+
+	fprintf(stderr, "%s:\n", title);
+	uint64_t below = UINT64_MAX;
+	int below_index = -1;
+	for (int shown = 0; shown < top; shown++) {
+		/* next largest count after the one shown last, ties in index order */
+		int best = -1;
+		for (int i = 0; i < n; i++) {
+			if (counts[i] == 0 || counts[i] > below || (counts[i] == below && i <= below_index)) {
+				continue;
+			}
+			if (best < 0 || counts[i] > counts[best]) {
+				best = i;
+			}
+		}
+		if (best < 0) {
+			break;
+		}
+
+		char seq[32] = "";
+		for (int k = len - 1, i = best; k >= 0; k--, i /= OPC_COUNT) {
+			char name[8];
+			snprintf(name, sizeof(name), "%-5s", opc_names[i % OPC_COUNT]);
+			memmove(seq + 5, seq, strlen(seq) + 1);
+			memcpy(seq, name, 5);
+		}
+		fprintf(stderr, "  %s %12llu  %5.1f%%\n", seq, (unsigned long long) counts[best],
+		        100.0 * counts[best] / total);
+		below = counts[best];
+		below_index = best;
+	}
+}
+
+void print_op_profile()
+{
+	print_profile("instruction pairs", op_pairs, OPC_COUNT * OPC_COUNT, 2, 15);
+	print_profile("instruction triples", op_triples, OPC_COUNT * OPC_COUNT * OPC_COUNT, 3, 15);
+}
+
+/* the guest ran RTI or the reserved opcode: report where and abort */
+void crash(uint16_t address, uint16_t instr, const uint16_t *r)
+{
+	char where[48];
+
+	writer_stop();
+	restore_input_buffering();
+	format_address(where, sizeof(where), address);
+	fprintf(stderr, "illegal instruction x%04X at %s\n", instr, where);
+	for (int i = R_R0; i <= R_R7; i++) {
+		fprintf(stderr, "R%d x%04X%c", i, r[i], i == R_R7 ? '\n' : ' ');
+	}
+	fprintf(stderr, "COND x%04X\n", r[R_COND]);
+	abort();
+}
+
+
+/* run the program for at most `slice` instructions */
+int run_vm(int slice)
+{
+	/* --interpreter switch is the plain fetch and dispatch loop */
+	int tiered = interpreter == INTERP_TIERED;
+	int profiling = op_pairs != NULL;
+
+	/* instructions that do not get to run are taken back on return */
+	instr_count += slice;
+	slice_left = slice;
+	if (tiered) {
+		install_compiled();
+	}
+
+	while (slice_left-- > 0) {
+		struct block *b = tiered ? block_map[reg[R_PC]] : NULL;
+		if (tiered && !b && ++heat[reg[R_PC]] >= TIER1_THRESHOLD) {
+			b = translate(reg[R_PC]);
+		}
+		if (b && b->count > 0 && b->count <= slice_left + 1) {
+			if (++b->runs == 0) {
+				halve_profile(b);
+			}
+			if (b->runs >= TIER2_THRESHOLD && !b->queued) {
+				queue_block(b);
+			}
+			slice_left -= b->count - 1;
+			cache_stats.in_blocks += b->count;
+			slice_left += exec_block(b);
+
+			/* a backward branch: enter the loop's optimized block as soon as it is ready */
+			if (back_edge) {
+				struct block *head = block_map[reg[R_PC]];
+				if (head && head->tier == 1 && !head->queued && head->runs >= OSR_THRESHOLD) {
+					queue_block(head);
+				}
+				install_compiled();
+			}
+			continue;
+		}
+
+		if (tiered) {
+			cache_stats.interpreted++;
+		}
+
+		/* FETCH */
+		uint16_t instr = mem_read(reg[R_PC]++);
+		if (profiling) {
+			profile_op(instr);
+		}
+		uint16_t op = instr >> 12;
+
+		switch (op) {
+		case OP_ADD:
+			op_ADD(instr);
+			break;
+		case OP_AND:
+			op_AND(instr);
+			break;
+		case OP_NOT:
+			op_NOT(instr);
+			break;
+		case OP_BR:
+			op_BR(instr);
+			break;
+		case OP_JMP:
+			op_JMP(instr);
+			break;
+		case OP_JSR:
+			op_JSR(instr);
+			break;
+		case OP_LD:
+			op_LD(instr);
+			break;
+		case OP_LDI:
+			op_LDI(instr);
+			break;
+		case OP_LDR:
+			op_LDR(instr);
+			break;
+		case OP_LEA:
+			op_LEA(instr);
+			break;
+		case OP_ST:
+			op_ST(instr);
+			break;
+		case OP_STI:
+			op_STI(instr);
+			break;
+		case OP_STR:
+			op_STR(instr);
+			break;
+		case OP_TRAP: {
+			int state = run_trap(instr);
+			if (state != VM_CONTINUE) {
+				return state;
+			}
+			break;
+		}
+		case OP_RES:
+		case OP_RTI:
+		default:
+			crash(reg[R_PC] - 1, instr, reg);
+			break;
+		}
+	}
+
+	return VM_YIELD;
+}
+
+/*** Threaded Interpreter ***/
+/*
+ * Every instruction has a handler that ends by calling the handler of
+ * the next one, passing PC, the register file, the instruction and the
+ * instructions left in the time slice, so they stay in host registers
+ * with no central loop. With musttail (clang) every call is a jump;
+ * otherwise the compiler is trusted to turn them into jumps at -O2, and
+ * the chain is cut every THREADED_RUN instructions in case it does not.
+ * musttail needs caller and callee to have the same prototype, so step()
+ * and next() take an instruction too, which they do not use.
+ */
+#if defined(__has_attribute)
+#if __has_attribute(musttail)
+#define MUSTTAIL __attribute__((musttail))
+#endif
+#endif
+
+#ifdef MUSTTAIL
+enum { THREADED_RUN = 0 };
+#else
+#define MUSTTAIL
+enum { THREADED_RUN = 4096 };  /* a power of two */
+#endif
+
+typedef int handler_fn(uint16_t pc, uint16_t *r, uint16_t instr, int left);
+
+handler_fn *handlers[16];
+
+/* run the instruction at `pc` */
+int step(uint16_t pc, uint16_t *r, uint16_t instr, int left)
+{
+	if (pc == MR_KBSR || pc == MR_KBDR) {
+		slice_left = left;
+		instr = mem_read(pc);
+		left = slice_left;
+	} else {
+		instr = memory[pc];
+	}
+	MUSTTAIL return handlers[instr >> 12](pc + 1, r, instr, left - 1);
+}
+
+/* continue with the next instruction, unless the slice is over */
+int next(uint16_t pc, uint16_t *r, uint16_t instr, int left)
+{
+	if (left <= 0 || (THREADED_RUN && (left & (THREADED_RUN - 1)) == 0)) {
+		r[R_PC] = pc;
+		slice_left = left;
+		return left <= 0 ? VM_YIELD : VM_CONTINUE;
+	}
+	MUSTTAIL return step(pc, r, instr, left);
+}
+
+int h_ADD(uint16_t pc, uint16_t *r, uint16_t instr, int left)
+{
+	uint16_t DR = (instr >> 9) & 0x7;
+
+	if ((instr >> 5) & 0x1) {
+		r[DR] = r[(instr >> 6) & 0x7] + sign_extend(instr & 0x1F, 5);
+	} else {
+		r[DR] = r[(instr >> 6) & 0x7] + r[instr & 0x7];
+	}
+	r[R_COND] = flags_of(r[DR]);
+	MUSTTAIL return next(pc, r, instr, left);
+}
+
+int h_AND(uint16_t pc, uint16_t *r, uint16_t instr, int left)
+{
+	uint16_t DR = (instr >> 9) & 0x7;
+
+	if ((instr >> 5) & 0x1) {
+		r[DR] = r[(instr >> 6) & 0x7] & sign_extend(instr & 0x1F, 5);
+	} else {
+		r[DR] = r[(instr >> 6) & 0x7] & r[instr & 0x7];
+	}
+	r[R_COND] = flags_of(r[DR]);
+	MUSTTAIL return next(pc, r, instr, left);
+}
+
+int h_NOT(uint16_t pc, uint16_t *r, uint16_t instr, int left)
+{
+	uint16_t DR = (instr >> 9) & 0x7;
+
+	r[DR] = ~r[(instr >> 6) & 0x7];
+	r[R_COND] = flags_of(r[DR]);
+	MUSTTAIL return next(pc, r, instr, left);
+}
+
+int h_BR(uint16_t pc, uint16_t *r, uint16_t instr, int left)
+{
+	if (((instr >> 9) & 0x7) & r[R_COND]) {
+		pc += sign_extend(instr & 0x1ff, 9);
+	}
+	MUSTTAIL return next(pc, r, instr, left);
+}
+
+int h_JMP(uint16_t pc, uint16_t *r, uint16_t instr, int left)
+{
+	(void) pc;
+	MUSTTAIL return next(r[(instr >> 6) & 0x7], r, instr, left);
+}
+
+int h_JSR(uint16_t pc, uint16_t *r, uint16_t instr, int left)
+{
+	/* like op_JSR, R7 is written before the base register is read */
+	r[R_R7] = pc;
+	if ((instr >> 11) & 1) {
+		pc += sign_extend(instr & 0x7ff, 11);
+	} else {
+		pc = r[(instr >> 6) & 0x7];
+	}
+	MUSTTAIL return next(pc, r, instr, left);
+}
+
+int h_LD(uint16_t pc, uint16_t *r, uint16_t instr, int left)
+{
+	uint16_t DR = (instr >> 9) & 0x7;
+
+	slice_left = left;
+	r[DR] = mem_read(pc + sign_extend(instr & 0x1ff, 9));
+	r[R_COND] = flags_of(r[DR]);
+	MUSTTAIL return next(pc, r, instr, slice_left);
+}
+
+int h_LDI(uint16_t pc, uint16_t *r, uint16_t instr, int left)
+{
+	uint16_t DR = (instr >> 9) & 0x7;
+
+	slice_left = left;
+	r[DR] = mem_read(mem_read(pc + sign_extend(instr & 0x1ff, 9)));
+	r[R_COND] = flags_of(r[DR]);
+	MUSTTAIL return next(pc, r, instr, slice_left);
+}
+
+int h_LDR(uint16_t pc, uint16_t *r, uint16_t instr, int left)
+{
+	uint16_t DR = (instr >> 9) & 0x7;
+
+	slice_left = left;
+	r[DR] = mem_read(r[(instr >> 6) & 0x7] + sign_extend(instr & 0x3F, 6));
+	r[R_COND] = flags_of(r[DR]);
+	MUSTTAIL return next(pc, r, instr, slice_left);
+}
+
+int h_LEA(uint16_t pc, uint16_t *r, uint16_t instr, int left)
+{
+	uint16_t DR = (instr >> 9) & 0x7;
+
+	r[DR] = pc + sign_extend(instr & 0x1ff, 9);
+	r[R_COND] = flags_of(r[DR]);
+	MUSTTAIL return next(pc, r, instr, left);
+}
+
+int h_ST(uint16_t pc, uint16_t *r, uint16_t instr, int left)
+{
+	mem_write(pc + sign_extend(instr & 0x1ff, 9), r[(instr >> 9) & 0x7]);
+	MUSTTAIL return next(pc, r, instr, left);
+}
+
+int h_STI(uint16_t pc, uint16_t *r, uint16_t instr, int left)
+{
+	slice_left = left;
+	mem_write(mem_read(pc + sign_extend(instr & 0x1ff, 9)), r[(instr >> 9) & 0x7]);
+	MUSTTAIL return next(pc, r, instr, slice_left);
+}
+
+int h_STR(uint16_t pc, uint16_t *r, uint16_t instr, int left)
+{
+	mem_write(r[(instr >> 6) & 0x7] + sign_extend(instr & 0x3F, 6), r[(instr >> 9) & 0x7]);
+	MUSTTAIL return next(pc, r, instr, left);
+}
+
+/* traps use the registers and the console, and may end the slice */
+int h_TRAP(uint16_t pc, uint16_t *r, uint16_t instr, int left)
+{
+	int state;
+
+	r[R_PC] = pc;
+	slice_left = left;
+	state = run_trap(instr);
+	if (state != VM_CONTINUE) {
+		return state;
+	}
+	MUSTTAIL return next(r[R_PC], r, instr, slice_left);
+}
+
+int h_BAD(uint16_t pc, uint16_t *r, uint16_t instr, int left)
+{
+	(void) left;
+	crash(pc - 1, instr, r);
+	return VM_HALTED;
+}
+
+handler_fn *handlers[16] =
+{
+	[OP_BR]  = h_BR,  [OP_ADD] = h_ADD, [OP_LD]  = h_LD,  [OP_ST]   = h_ST,
+	[OP_JSR] = h_JSR, [OP_AND] = h_AND, [OP_LDR] = h_LDR, [OP_STR]  = h_STR,
+	[OP_RTI] = h_BAD, [OP_NOT] = h_NOT, [OP_LDI] = h_LDI, [OP_STI]  = h_STI,
+	[OP_JMP] = h_JMP, [OP_RES] = h_BAD, [OP_LEA] = h_LEA, [OP_TRAP] = h_TRAP
+};
+
+/* run_vm() for --interpreter threaded */
+int run_threaded(int slice)
+{
+	int state;
+
+	instr_count += slice;
+	slice_left = slice;
+	do {
+		state = step(reg[R_PC], reg, 0, slice_left);
+	} while (state == VM_CONTINUE);
+
+	return state;
+}
+
+enum { PC_START = 0x3000 };  /* 0x3000 is the default starting position */
+
+/* start the loaded program from scratch with the console state cleared */
+void reset_vm()
+{
+	memset(reg, 0, sizeof(reg));
+	reg[R_PC] = PC_START;
+	instr_count = 0;
+
+	if (cache_image_hash != image_hash) {
+		flush_cache();
+		cache_image_hash = image_hash;
+	}
+	vm_stopped = 0;
+
+	in_data = in_buf;
+	in_head = in_tail = 0;
+	in_eof = 0;
+	in_prompted = 0;
+	out_len = 0;
+}
+
+/*
+ * the event loop: run time slices until the program halts or executed
+ * `budget` instructions (0 means no limit), waiting for input whenever
+ * the program blocks on it
+ */
+int run_program(uint64_t budget)
+{
+	int state;
+
+	do {
+		int slice = TIME_SLICE;
+		if (budget) {
+			if (instr_count >= budget) {
+				return VM_BUDGET;
+			}
+			if (budget - instr_count < (uint64_t) slice) {
+				slice = budget - instr_count;
+			}
+		}
+
+		state = interpreter == INTERP_THREADED ? run_threaded(slice) : run_vm(slice);
+		/* the slice is over, stop_vm() has nothing left to take back */
+		slice_left = 0;
+		/* output is written once per time slice, not once per character */
+		console_flush();
+		if (vm_stopped || interrupted) {
+			return VM_STOPPED;
+		}
+		if (state == VM_BLOCKED) {
+			wait_key();
+		}
+	} while (state != VM_HALTED);
+
+	return VM_HALTED;
+}
+
+
+/*** Persistent Translation Cache ***/
+/*
+ * with --translation-cache <dir>, the blocks translated for an image and
+ * their run and branch counts are saved to <dir>/<image hash>.lc3t and loaded again
+ * when the same image starts, so a short run does not pay for the
+ * translation again. A file is only used if its format, VM version, image
+ * hash and checksum match and every block in it is well formed.
+ */
+enum { TCACHE_FORMAT = 6 };  /* bump when struct uop or the records change */
+
+struct tcache_header
+{
+	char     magic[4];  /* "LC3T" */
+	uint32_t format;
+	uint64_t version;   /* hash of LC3_VM_VERSION */
+	uint64_t image;     /* image_hash */
+	uint64_t size;      /* bytes of block records that follow */
+	uint64_t checksum;  /* hash of the block records */
+};
+
+struct tcache_block
+{
+	uint16_t start, end, count, len;
+	uint32_t runs, taken;  /* the branch profile goes with the run count */
+};
+
+const char *tcache_dir;
+
+void tcache_path(char *path, size_t size)
+{
+	snprintf(path, size, "%s/%016llx.lc3t", tcache_dir, (unsigned long long) image_hash);
+}
+
+/* check a saved block before it goes into the cache */
+int valid_block(const struct tcache_block *rec, const struct uop *ops)
+{
+	if (rec->len == 0 || rec->len > BLOCK_MAX_OPS || rec->count >= BLOCK_MAX_OPS
+	    || rec->start > rec->end || rec->end > MR_KBSR || rec->taken > rec->runs) {
+		return 0;
+	}
+	/* a block starting on a TRAP is empty: a single U_EXIT */
+	if (rec->start == rec->end) {
+		return rec->count == 0 && rec->len == 1 && ops[0].op == U_EXIT;
+	}
+	if (rec->start / PAGE_WORDS != (rec->end - 1) / PAGE_WORDS) {
+		return 0;
+	}
+	for (int i = 0; i < rec->len; i++) {
+		if (ops[i].op > U_EXIT || ops[i].dr > 7 || ops[i].sr1 > 7 || ops[i].sr2 > 7
+		    || ops[i].n > rec->count) {
+			return 0;
+		}
+	}
+	/* the last micro-op must leave the block */
+	return ops[rec->len - 1].op >= U_BR;
+}
+
+void load_translations()
+{
+	struct tcache_header header;
+	char path[4096];
+	size_t len;
+
+	if (!tcache_dir || cache_image_hash != image_hash || !image_hash
+	    || interpreter != INTERP_TIERED) {
+		return;
+	}
+
+	tcache_path(path, sizeof(path));
+	char *data = read_file(path, &len);
+	if (!data) {
+		return;
+	}
+
+	memcpy(&header, data, len < sizeof(header) ? len : sizeof(header));
+	if (len < sizeof(header) || memcmp(header.magic, "LC3T", 4) != 0
+	    || header.format != TCACHE_FORMAT
+	    || header.version != hash_bytes(hash_init(), LC3_VM_VERSION, sizeof(LC3_VM_VERSION))
+	    || header.image != image_hash || header.size != len - sizeof(header)
+	    || header.checksum != hash_bytes(hash_init(), data + sizeof(header), header.size)) {
+		free(data);
+		return;
+	}
+
+	for (size_t at = sizeof(header); at + sizeof(struct tcache_block) <= len; ) {
+		struct tcache_block rec;
+		memcpy(&rec, data + at, sizeof(rec));
+		at += sizeof(rec);
+
+		const struct uop *ops = (const struct uop *) (data + at);
+		if (at + rec.len * sizeof(struct uop) > len) {
+			break;
+		}
+		at += rec.len * sizeof(struct uop);
+
+		/* a bad record is skipped, the ones after it are still good */
+		if (!valid_block(&rec, ops) || block_map[rec.start]) {
+			continue;
+		}
+		cache_flushed = 0;
+		struct block *b = alloc_block(rec.len);
+		if (cache_flushed) {
+			break;
+		}
+		b->start = rec.start;
+		b->end = rec.end;
+		b->count = rec.count;
+		b->len = rec.len;
+		b->runs = rec.runs;
+		b->taken = rec.taken;
+		b->tier = 1;
+		b->base = NULL;
+		b->queued = 0;
+		memcpy(b->ops, ops, rec.len * sizeof(struct uop));
+		install_block(b);
+	}
+	free(data);
+}
+
+void save_translations()
+{
+	struct tcache_header header = { { 'L', 'C', '3', 'T' }, TCACHE_FORMAT, 0, image_hash, 0, 0 };
+	char path[4096], tmp[sizeof(path) + 8];
+
+	/* blocks read from modified memory do not belong to the image */
+	if (!tcache_dir || cache_image_hash != image_hash || !image_hash) {
+		return;
+	}
+
+	header.version = hash_bytes(hash_init(), LC3_VM_VERSION, sizeof(LC3_VM_VERSION));
+	header.checksum = hash_init();
+	for (int page = 0; page < PAGE_COUNT; page++) {
+		for (struct block *b = page_blocks[page]; b; b = b->page_next) {
+			struct tcache_block rec = { b->start, b->end, b->count, b->len, b->runs, b->taken };
+			header.checksum = hash_bytes(header.checksum, &rec, sizeof(rec));
+			header.checksum = hash_bytes(header.checksum, b->ops, b->len * sizeof(struct uop));
+			header.size += sizeof(rec) + b->len * sizeof(struct uop);
+		}
+	}
+
+	tcache_path(path, sizeof(path));
+	snprintf(tmp, sizeof(tmp), "%s.XXXXXX", path);
+	int fd = mkstemp(tmp);
+	if (fd < 0) {
+		return;
+	}
+
+	FILE *file = fdopen(fd, "wb");
+	int ok = fwrite(&header, sizeof(header), 1, file) == 1;
+	for (int page = 0; page < PAGE_COUNT && ok; page++) {
+		for (struct block *b = page_blocks[page]; b && ok; b = b->page_next) {
+			struct tcache_block rec = { b->start, b->end, b->count, b->len, b->runs, b->taken };
+			ok = fwrite(&rec, sizeof(rec), 1, file) == 1
+			  && fwrite(b->ops, sizeof(struct uop), b->len, file) == b->len;
+		}
+	}
+	ok = fclose(file) == 0 && ok;
+
+	if (!ok || rename(tmp, path) < 0) {
+		unlink(tmp);
+	}
+}
+
+/*** Result Cache ***/
+/*
+ * with --cache <dir>, runs whose whole input is known up front (daemon
+ * jobs and test suite tests) are looked up in an on-disk cache first.
+ * An entry is keyed by the hash of the loaded images, the input, the
+ * budget and LC3_VM_VERSION, and records the final state, instruction
+ * count and output. Entries are written to a temporary file and renamed
+ * into place, so concurrent runners only ever see complete entries.
+ */
+struct cache_header
+{
+	char     magic[4];  /* "LC3R" */
+	uint32_t state;
+	uint64_t key;
+	uint64_t instructions;
+	uint64_t output_len;
+};
+
+const char *cache_dir;
+
+uint64_t cache_key(uint64_t budget)
+{
+	uint64_t h = hash_init();
+
+	h = hash_bytes(h, LC3_VM_VERSION, sizeof(LC3_VM_VERSION));
+	h = hash_bytes(h, &image_hash, sizeof(image_hash));
+	h = hash_bytes(h, &budget, sizeof(budget));
+	h = hash_bytes(h, &in_tail, sizeof(in_tail));
+	return hash_bytes(h, in_data, in_tail);
+}
+
+void cache_path(char *path, size_t size, uint64_t key)
+{
+	snprintf(path, size, "%s/%016llx", cache_dir, (unsigned long long) key);
+}
+
+/* replay a cached run through out_sink, returns its state or -1 on a miss */
+int cache_replay(uint64_t key)
+{
+	struct cache_header header;
+	char path[4096];
+	char chunk[CHUNK_SIZE];
+
+	cache_path(path, sizeof(path), key);
+	FILE *file = fopen(path, "rb");
+	if (!file) {
+		return -1;
+	}
+
+	/* the whole entry is checked before any output is replayed */
+	struct stat st;
+	if (fread(&header, sizeof(header), 1, file) != 1
+	    || memcmp(header.magic, "LC3R", 4) != 0 || header.key != key
+	    || fstat(fileno(file), &st) < 0
+	    || (uint64_t) st.st_size != sizeof(header) + header.output_len) {
+		fclose(file);
+		return -1;
+	}
+
+	size_t n;
+	while ((n = fread(chunk, 1, sizeof(chunk), file)) > 0) {
+		out_sink(chunk, n);
+	}
+	fclose(file);
+
+	instr_count = header.instructions;
+	return header.state;
+}
+
+void cache_store(uint64_t key, int state)
+{
+	struct cache_header header = { { 'L', 'C', '3', 'R' }, state, key, instr_count, record_len };
+	char path[4096], tmp[sizeof(path) + 8];
+
+	cache_path(path, sizeof(path), key);
+	snprintf(tmp, sizeof(tmp), "%s.XXXXXX", path);
+
+	int fd = mkstemp(tmp);
+	if (fd < 0) {
+		return;
+	}
+
+	FILE *file = fdopen(fd, "wb");
+	int ok = fwrite(&header, sizeof(header), 1, file) == 1
+	      && fwrite(record_buf, 1, record_len, file) == record_len;
+	ok = fclose(file) == 0 && ok;
+
+	if (!ok || rename(tmp, path) < 0) {
+		unlink(tmp);
+	}
+}
+
+/* run_program() for runs whose whole input is already in in_data */
+int run_cached(uint64_t budget)
+{
+	if (!cache_dir) {
+		return run_program(budget);
+	}
+
+	uint64_t key = cache_key(budget);
+	int state = cache_replay(key);
+	if (state >= 0) {
+		return vm_stopped ? VM_STOPPED : state;
+	}
+
+	recording = 1;
+	record_len = 0;
+	state = run_program(budget);
+	if (recording && (state == VM_HALTED || state == VM_BUDGET)) {
+		cache_store(key, state);
+	}
+	recording = 0;
+	return state;
+}
+
+
+/*** Daemon ***/
+/*
+ * --daemon listens on a unix socket and runs one job per connection on a
+ * pool of pre-forked workers that already have the command line images
+ * loaded. A job request is a sequence of lines:
+ *
+ *   image <path>             load an image file (repeatable)
+ *   image-data <n>           followed by n bytes of an image (repeatable)
+ *   input <n>                followed by n bytes of console input
+ *   budget <n>               stop after n instructions
+ *   run                      start the job
+ *   stats                    reply with the worker's code cache statistics
+ *
+ * Without image lines the command line images are used. The reply streams
+ * the output as "out <n>" lines each followed by n bytes, and ends with
+ *
+ *   status <halted|budget> instructions <n> usec <n>
+ *
+ * or with "error <message>" if the request could not be run; a client
+ * that takes longer than JOB_TIMEOUT seconds to send its request gets
+ * "error timeout", so idle connections cannot hold on to the workers.
+ */
+enum
+{
+	JOB_MAX_DATA = 16 << 20,  /* largest image-data / input payload      */
+	JOB_TIMEOUT  = 10         /* seconds to send a request, or for a write */
+};
+
+int job_fd = -1;
+volatile sig_atomic_t job_timed_out;
+
+/* SIGALRM interrupts the worker's reads once the request is overdue */
+void job_alarm(int signal)
+{
+	(void) signal;
+	job_timed_out = 1;
+}
+
+void job_sink(const char *buf, size_t len)
+{
+	char header[32];
+	int n = snprintf(header, sizeof(header), "out %zu\n", len);
 
-	update_flags(DR);
+	if (write(job_fd, header, n) != n || write(job_fd, buf, len) != (ssize_t) len) {
+		/* the client went away */
+		stop_vm();
+	}
 }
 
-/*** LEA ***/
-void op_LEA(uint16_t instr)
+void job_reply(const char *fmt, ...)
 {
-	/* destination register (DR) */
-	uint16_t DR = (instr >> 9) & 0x7;
-	/* PCoffset9 */
-	uint16_t PC_offset = sign_extend(instr & 0x1ff, 9);
+	char line[256];
+	va_list args;
 
-	/* add pc_offset to the current PC, and load this address into destination register */
-	reg[DR] = reg[R_PC] + PC_offset;
+	va_start(args, fmt);
+	int n = vsnprintf(line, sizeof(line), fmt, args);
+	va_end(args);
 
-	update_flags(DR);
+	write_all(job_fd, line, n);
 }
 
-/*** ST ***/
-void op_ST(uint16_t instr)
+/* read a "<n>\n" payload following a request line */
+char *job_payload(FILE *in, const char *len_str, size_t *len)
 {
-	/* source register */
-	uint16_t SR = (instr >> 9) & 0x7;
-	/* PCoffset9 */
-	uint16_t PC_offset = sign_extend(instr & 0x1ff, 9);
+	char *end;
+	unsigned long n = strtoul(len_str, &end, 10);
+	char *data;
 
-	mem_write(reg[R_PC] + PC_offset, reg[SR]);
+	if (end == len_str || n > JOB_MAX_DATA || !(data = malloc(n ? n : 1))) {
+		return NULL;
+	}
+	if (fread(data, 1, n, in) != n) {
+		free(data);
+		return NULL;
+	}
+	*len = n;
+	return data;
 }
 
-/*** STI ***/
-void op_STI(uint16_t instr)
+void run_job(int fd)
 {
-	/* source register */
-	uint16_t SR = (instr >> 9) & 0x7;
-	/* PCoffset9 */
-	uint16_t PC_offset = sign_extend(instr & 0x1ff, 9);
+	FILE *in = fdopen(fd, "rb");
+	char line[4096];
+	char *input = NULL;
+	size_t input_len = 0;
+	uint64_t budget = 0;
+	int has_image = 0;
+	int ready = 0;
+
+	struct timeval start, end;
+	gettimeofday(&start, NULL);
+
+	job_fd = fd;
+	job_timed_out = 0;
+	alarm(JOB_TIMEOUT);
+
+	while (!ready && !job_timed_out && fgets(line, sizeof(line), in)) {
+		line[strcspn(line, "\n")] = '\0';
+
+		char *arg = strchr(line, ' ');
+		if (arg) {
+			*arg++ = '\0';
+		} else {
+			arg = line + strlen(line);
+		}
 
-	mem_write(mem_read(reg[R_PC] + PC_offset), reg[SR]);
+		if (strcmp(line, "run") == 0) {
+			ready = 1;
+		} else if (strcmp(line, "stats") == 0) {
+			char stats[512];
+			write_all(fd, stats, format_cache_stats(stats, sizeof(stats)));
+			goto done;
+		} else if (strcmp(line, "budget") == 0) {
+			budget = strtoull(arg, NULL, 10);
+		} else if (strcmp(line, "input") == 0) {
+			free(input);
+			if (!(input = job_payload(in, arg, &input_len))) {
+				job_reply(job_timed_out ? "error timeout\n" : "error bad input\n");
+				goto done;
+			}
+		} else if (strcmp(line, "image") == 0 || strcmp(line, "image-data") == 0) {
+			if (!has_image) {
+				clear_memory();
+				image_hash = 0;
+				symbol_first = symbol_count;
+				has_image = 1;
+			}
+
+			int loaded;
+			if (line[5] == '\0') {
+				loaded = read_image(arg);
+			} else {
+				size_t len;
+				char *data = job_payload(in, arg, &len);
+				loaded = data && read_image_data(data, len);
+				free(data);
+			}
+			if (!loaded) {
+				job_reply(job_timed_out ? "error timeout\n" : "error failed to load image\n");
+				goto done;
+			}
+		} else {
+			job_reply("error unknown request: %s\n", line);
+			goto done;
+		}
+	}
+
+	alarm(0);
+	if (!ready) {
+		job_reply(job_timed_out ? "error timeout\n" : "error incomplete request\n");
+		goto done;
+	}
+
+	if (!has_image) {
+		restore_base_memory();
+	}
+	reset_vm();
+
+	/* the whole input is known, so the console never waits for more */
+	if (input) {
+		in_data = input;
+		in_tail = input_len;
+	}
+	in_eof = 1;
+	out_sink = job_sink;
+
+	int state = run_cached(budget);
+	if (state != VM_STOPPED) {
+		gettimeofday(&end, NULL);
+		job_reply("status %s instructions %llu usec %lld\n",
+		          state == VM_HALTED ? "halted" : "budget",
+		          (unsigned long long) instr_count,
+		          (long long) (end.tv_sec - start.tv_sec) * 1000000
+		          + (end.tv_usec - start.tv_usec));
+	}
+
+done:
+	alarm(0);
+	free(input);
+	fclose(in);
+	job_fd = -1;
+	/* an idle worker keeps no guest pages, nor the job's symbols */
+	clear_memory();
+	if (has_image) {
+		symbol_count = symbol_first;
+		symbol_first = 0;
+	}
 }
 
-/*** STR ***/
-void op_STR(uint16_t instr)
+void worker_main(int listen_fd)
 {
-	/* source register */
-	uint16_t    SR = (instr >> 9) & 0x7;
-	/* base register */
-	uint16_t BaseR = (instr >> 6) & 0x7;
-	/* offset6 */
-	uint16_t offset = sign_extend(instr & 0x3f, 6);
+	struct timeval timeout = { JOB_TIMEOUT, 0 };
+	struct sigaction sa;
+
+	/* no SA_RESTART, so the alarm ends a read that is waiting on the client */
+	memset(&sa, 0, sizeof(sa));
+	sa.sa_handler = job_alarm;
+	sigemptyset(&sa.sa_mask);
+	sigaction(SIGALRM, &sa, NULL);
+
+	for (;;) {
+		int fd = accept(listen_fd, NULL, NULL);
+		if (fd < 0) {
+			if (errno == EINTR || errno == ECONNABORTED) {
+				continue;
+			}
+			exit(1);
+		}
+		/* a client that stops reading its output is treated as gone */
+		setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+		setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+		run_job(fd);
+	}
+}
 
-	mem_write(reg[BaseR] + offset, reg[SR]);
+const char *daemon_socket_path;
+pid_t      *worker_pids;
+int         worker_count;
+
+/* take the worker pool down with the daemon */
+void stop_daemon(int signal)
+{
+	(void) signal;
+	for (int i = 0; i < worker_count; i++) {
+		kill(worker_pids[i], SIGTERM);
+	}
+	unlink(daemon_socket_path);
+	_exit(0);
 }
 
-/*** TRAP ***/
-void op_TRAP(uint16_t instr)
+pid_t spawn_worker(int listen_fd)
 {
-	/* trapvect8 */
-	uint16_t trap_vect = sign_extend(instr & 0xff, 8);
+	pid_t pid = fork();
 
-	reg[R_R7] = reg[R_PC];
-	reg[R_PC] = mem_read(trap_vect);
+	if (pid == 0) {
+		signal(SIGINT, SIG_DFL);
+		signal(SIGTERM, SIG_DFL);
+		worker_main(listen_fd);
+		exit(0);
+	}
+	return pid;
 }
 
-
-/*** TRAP_GETC ***/
-void trap_GETC()
+int run_daemon(const char *socket_path, int workers)
 {
-	reg[R_R0] = (uint16_t) getchar();
+	struct sockaddr_un addr;
+
+	if (strlen(socket_path) >= sizeof(addr.sun_path)) {
+		printf("Socket path too long: %s\n", socket_path);
+		return 1;
+	}
+	memset(&addr, 0, sizeof(addr));
+	addr.sun_family = AF_UNIX;
+	strcpy(addr.sun_path, socket_path);
+
+	int listen_fd = socket(AF_UNIX, SOCK_STREAM, 0);
+	unlink(socket_path);
+	if (listen_fd < 0
+	    || bind(listen_fd, (struct sockaddr *) &addr, sizeof(addr)) < 0
+	    || listen(listen_fd, SOMAXCONN) < 0) {
+		printf("Failed to listen on %s\n", socket_path);
+		return 1;
+	}
+
+	/* a client hanging up must not kill the worker serving it */
+	signal(SIGPIPE, SIG_IGN);
+	daemon_socket_path = socket_path;
+
+	if (!(base_memory = alloc_memory())) {
+		printf("Failed to allocate memory\n");
+		return 1;
+	}
+	memcpy(base_memory, memory, MEMORY_BYTES);
+	base_loaded_pages = loaded_pages;
+	base_image_hash = image_hash;
+	share_base_memory();
+
+	/* the workers inherit the translated image */
+	reset_vm();
+	load_translations();
+	translate_image(PC_START);
+	save_translations();
+	clear_memory();
+	worker_pids = calloc(workers, sizeof(pid_t));
+	for (int i = 0; i < workers; i++) {
+		worker_pids[i] = spawn_worker(listen_fd);
+	}
+	worker_count = workers;
+	signal(SIGINT, stop_daemon);
+	signal(SIGTERM, stop_daemon);
+
+	/* keep the pool at full size */
+	for (;;) {
+		pid_t pid = wait(NULL);
+		if (pid < 0) {
+			if (errno == EINTR) {
+				continue;
+			}
+			return 1;
+		}
+		for (int i = 0; i < workers; i++) {
+			if (worker_pids[i] == pid) {
+				worker_pids[i] = spawn_worker(listen_fd);
+			}
+		}
+	}
 }
 
-/*** TRAP_OUT ***/
-void trap_OUT()
+/*** Test Suite ***/
+/*
+ * --test-suite runs the loaded program once per NAME.out file in a
+ * directory, feeding it NAME.in (if present) as console input and
+ * comparing the output with NAME.out while it is produced. Every test
+ * runs in its own forked process, up to --jobs at a time, and stops at
+ * the first mismatching byte. A JSON (or --report junit) report goes to
+ * stdout.
+ */
+enum
 {
-	putc((char) reg[R_R0], stdout);
-	fflush(stdout);
-}
+	TEST_PASS = 0,
+	TEST_FAIL,      /* the output differs from the expected output */
+	TEST_BUDGET,    /* the instruction budget ran out */
+	TEST_ERROR      /* the test files could not be read */
+};
 
-/*** TRAP_PUTS ***/
-void trap_PUTS()
+const char *test_status_names[] = { "pass", "fail", "budget", "error" };
+
+struct test_result
 {
-	/* one char per word */
-	uint16_t *c = memory + reg[R_R0];
+	int      status;
+	uint64_t instructions;
+	long     mismatch;  /* offset of the first wrong byte, or -1 */
+};
 
-	while (*c) {
-		putc((char) *c, stdout);
-		c++;
+struct test
+{
+	char              *name;
+	pid_t              pid;
+	int                fd;  /* read end of the result pipe */
+	struct timeval     start;
+	long long          usec;
+	struct test_result result;
+};
+
+const char *expected;
+size_t      expected_len;
+size_t      compared;
+long        mismatch = -1;
+
+void compare_sink(const char *buf, size_t len)
+{
+	for (size_t i = 0; i < len; i++, compared++) {
+		if (compared >= expected_len || buf[i] != expected[compared]) {
+			mismatch = compared;
+			stop_vm();
+			return;
+		}
 	}
-	fflush(stdout);
 }
 
-/*** TRAP_IN ***/
-void trap_IN()
+/* runs in the forked process of a single test */
+struct test_result run_test(const char *dir, const char *name, uint64_t budget)
 {
-	char c;
+	struct test_result result = { TEST_ERROR, 0, -1 };
+	char path[4096];
+	size_t input_len = 0;
+	char *input;
+
+	snprintf(path, sizeof(path), "%s/%s.out", dir, name);
+	if (!(expected = read_file(path, &expected_len))) {
+		return result;
+	}
+	snprintf(path, sizeof(path), "%s/%s.in", dir, name);
+	input = read_file(path, &input_len);
 
-	printf("Enter a character: ");
-	c = getchar();
+	reset_vm();
+	if (input) {
+		in_data = input;
+		in_tail = input_len;
+	}
+	in_eof = 1;
+	/* stop at the first wrong character, not at the end of the slice */
+	out_sink = compare_sink;
+	out_unbuffered = 1;
+
+	int state = run_cached(budget);
+	if (state == VM_HALTED && compared < expected_len) {
+		/* the program stopped before writing all of the expected output */
+		mismatch = compared;
+	}
 
-	reg[R_R0] = (uint16_t) c;
-	putc(c, stdout);
+	result.instructions = instr_count;
+	result.mismatch = mismatch;
+	if (mismatch >= 0) {
+		result.status = TEST_FAIL;
+	} else if (state == VM_BUDGET) {
+		result.status = TEST_BUDGET;
+	} else {
+		result.status = TEST_PASS;
+	}
+	return result;
 }
 
-/*** TRAP_PUTSP ***/
-void trap_PUTSP()
+int compare_tests(const void *a, const void *b)
 {
-	/* two characters per word */
-	uint16_t *c = memory + reg[R_R0];
+	return strcmp(((const struct test *) a)->name, ((const struct test *) b)->name);
+}
 
-	while (*c) {
-		/* first character is bits[7:0] */
-		putc((char) (*c & 0xff), stdout);
+/* print a test name escaped for an XML attribute or a JSON string */
+void print_escaped(const char *s, int junit)
+{
+	for (; *s; s++) {
+		if ((unsigned char) *s < 0x20) {
+			putchar('?');
+		} else if (junit && strchr("\"&<>", *s)) {
+			printf(*s == '"' ? "&quot;" : *s == '&' ? "&amp;" : *s == '<' ? "&lt;" : "&gt;");
+		} else if (!junit && strchr("\"\\", *s)) {
+			printf("\\%c", *s);
+		} else {
+			putchar(*s);
+		}
+	}
+}
 
-		if ((*c >> 8) == 0)
-			break;
+void print_report(struct test *tests, int count, int junit)
+{
+	int failures = 0;
 
-		/* second character is bits[15:8] */
-		putc((char) ((*c >> 8 ) & 0xff), stdout);
-		c++;
+	for (int i = 0; i < count; i++) {
+		failures += tests[i].result.status != TEST_PASS;
+	}
+
+	if (junit) {
+		printf("<?xml version=\"1.0\" encoding=\"UTF-8\"?>\n");
+		printf("<testsuite name=\"lc3\" tests=\"%d\" failures=\"%d\">\n", count, failures);
+	} else {
+		printf("{\"tests\": %d, \"failures\": %d, \"results\": [\n", count, failures);
+	}
+
+	for (int i = 0; i < count; i++) {
+		struct test *t = &tests[i];
+
+		if (junit) {
+			printf("  <testcase name=\"");
+			print_escaped(t->name, junit);
+			printf("\" time=\"%lld.%06lld\"", t->usec / 1000000, t->usec % 1000000);
+			if (t->result.status == TEST_PASS) {
+				printf("/>\n");
+			} else {
+				printf(">\n    <failure message=\"%s", test_status_names[t->result.status]);
+				if (t->result.mismatch >= 0) {
+					printf(" at byte %ld", t->result.mismatch);
+				}
+				printf("\"/>\n  </testcase>\n");
+			}
+		} else {
+			printf("  {\"name\": \"");
+			print_escaped(t->name, junit);
+			printf("\", \"status\": \"%s\", \"instructions\": %llu, \"usec\": %lld, \"mismatch\": %ld}%s\n",
+			       test_status_names[t->result.status],
+			       (unsigned long long) t->result.instructions, t->usec,
+			       t->result.mismatch, i + 1 < count ? "," : "");
+		}
 	}
-	fflush(stdout);
+
+	printf(junit ? "</testsuite>\n" : "]}\n");
 }
 
-/*** TRAP_HALT ***/
-void trap_HALT(int *running)
+/* wait for one running test and collect its result */
+void reap_test(struct test *tests, int count)
+{
+	pid_t pid = wait(NULL);
+	struct timeval end;
+
+	gettimeofday(&end, NULL);
+	for (int i = 0; i < count; i++) {
+		struct test *t = &tests[i];
+		if (t->pid != pid) {
+			continue;
+		}
+
+		if (read(t->fd, &t->result, sizeof(t->result)) != sizeof(t->result)) {
+			t->result.status = TEST_ERROR;
+			t->result.mismatch = -1;
+		}
+		close(t->fd);
+		t->pid = 0;
+		t->usec = (long long) (end.tv_sec - t->start.tv_sec) * 1000000
+		        + (end.tv_usec - t->start.tv_usec);
+	}
+}
+
+int run_test_suite(const char *dir, int jobs, uint64_t budget, int junit)
 {
-	puts("HALT");
-	fflush(stdout);
-	*running = 0;
+	DIR *d = opendir(dir);
+	struct test *tests = NULL;
+	int count = 0;
+	struct dirent *entry;
+
+	if (!d) {
+		printf("Failed to open test directory: %s\n", dir);
+		return 2;
+	}
+
+	while ((entry = readdir(d))) {
+		size_t len = strlen(entry->d_name);
+		if (len <= 4 || strcmp(entry->d_name + len - 4, ".out") != 0) {
+			continue;
+		}
+
+		tests = realloc(tests, (count + 1) * sizeof(*tests));
+		memset(&tests[count], 0, sizeof(*tests));
+		tests[count].name = strdup(entry->d_name);
+		tests[count].name[len - 4] = '\0';
+		count++;
+	}
+	closedir(d);
+	qsort(tests, count, sizeof(*tests), compare_tests);
+
+	/* the tests inherit the translated image */
+	reset_vm();
+	load_translations();
+	translate_image(PC_START);
+	save_translations();
+
+	int running = 0;
+	for (int i = 0; i < count; i++) {
+		int fds[2];
+
+		if (running == jobs) {
+			reap_test(tests, count);
+			running--;
+		}
+
+		if (pipe(fds) < 0) {
+			tests[i].result.status = TEST_ERROR;
+			continue;
+		}
+
+		gettimeofday(&tests[i].start, NULL);
+		pid_t pid = fork();
+		if (pid == 0) {
+			struct test_result result = run_test(dir, tests[i].name, budget);
+			write(fds[1], &result, sizeof(result));
+			_exit(0);
+		}
+
+		close(fds[1]);
+		tests[i].pid = pid;
+		tests[i].fd = fds[0];
+		running++;
+	}
+	while (running-- > 0) {
+		reap_test(tests, count);
+	}
+
+	print_report(tests, count, junit);
+
+	int failed = 0;
+	for (int i = 0; i < count; i++) {
+		failed |= tests[i].result.status != TEST_PASS;
+		free(tests[i].name);
+	}
+	free(tests);
+	return failed;
 }
 
 int main(int argc, char *argv[])
 {
-	/* show usage string */
-	if (argc < 2) {
-		printf("LC3 [image-file1] ...\n");
-		exit(2);
+	const char *daemon_socket = NULL;
+	const char *test_dir = NULL;
+	int workers = sysconf(_SC_NPROCESSORS_ONLN);
+	uint64_t budget = 0;
+	int junit = 0;
+	int stats = 0;
+	int profile = 0;
+	int images = 0;
+
+	if (!(memory = alloc_memory())) {
+		printf("Failed to allocate memory\n");
+		exit(1);
 	}
 
 	for (int i = 1; i < argc; i++) {
+		if (strcmp(argv[i], "--daemon") == 0 && i + 1 < argc) {
+			daemon_socket = argv[++i];
+			continue;
+		}
+		if ((strcmp(argv[i], "--workers") == 0 || strcmp(argv[i], "--jobs") == 0) && i + 1 < argc) {
+			workers = atoi(argv[++i]);
+			continue;
+		}
+		if (strcmp(argv[i], "--test-suite") == 0 && i + 1 < argc) {
+			test_dir = argv[++i];
+			continue;
+		}
+		if (strcmp(argv[i], "--translation-cache") == 0 && i + 1 < argc) {
+			tcache_dir = argv[++i];
+			continue;
+		}
+		if (strcmp(argv[i], "--cache") == 0 && i + 1 < argc) {
+			cache_dir = argv[++i];
+			continue;
+		}
+		if (strcmp(argv[i], "--profile-ops") == 0) {
+			profile = 1;
+			continue;
+		}
+		if (strcmp(argv[i], "--interpreter") == 0 && i + 1 < argc) {
+			const char *name = argv[++i];
+			if (strcmp(name, "tiered") == 0) {
+				interpreter = INTERP_TIERED;
+			} else if (strcmp(name, "switch") == 0) {
+				interpreter = INTERP_SWITCH;
+			} else if (strcmp(name, "threaded") == 0) {
+				interpreter = INTERP_THREADED;
+			} else {
+				printf("Unknown interpreter: %s\n", name);
+				exit(2);
+			}
+			continue;
+		}
+		if (strcmp(argv[i], "--stats") == 0) {
+			stats = 1;
+			continue;
+		}
+		if (strcmp(argv[i], "--budget") == 0 && i + 1 < argc) {
+			budget = strtoull(argv[++i], NULL, 10);
+			continue;
+		}
+		if (strcmp(argv[i], "--report") == 0 && i + 1 < argc) {
+			junit = strcmp(argv[++i], "junit") == 0;
+			continue;
+		}
+		if (strcmp(argv[i], "--output-policy") == 0 && i + 1 < argc) {
+			const char *policy = argv[++i];
+			if (strcmp(policy, "block") == 0) {
+				out_policy = OUT_BLOCK;
+			} else if (strcmp(policy, "drop") == 0) {
+				out_policy = OUT_DROP;
+			} else if (strcmp(policy, "spill") == 0) {
+				out_policy = OUT_SPILL;
+			} else {
+				printf("Unknown output policy: %s\n", policy);
+				exit(2);
+			}
+			continue;
+		}
+
+		images++;
 		if (!read_image(argv[i])) {
 			printf("Failed to load image: %s\n", argv[i]);
 			exit(1);
 		}
 	}
 
+	if (daemon_socket) {
+		return run_daemon(daemon_socket, workers > 0 ? workers : 1);
+	}
+	if (test_dir) {
+		return run_test_suite(test_dir, workers > 0 ? workers : 1, budget, junit);
+	}
+
+	/* show usage string */
+	if (images == 0) {
+		printf("LC3 [--output-policy block|drop|spill] [--interpreter tiered|switch|threaded]\n"
+		       "    [--translation-cache dir] [--stats] [--profile-ops] [image-file1] ...\n");
+		printf("LC3 --daemon socket-path [--workers n] [--cache dir] [image-file1] ...\n");
+		printf("LC3 --test-suite dir [--jobs n] [--budget n] [--report json|junit] [--cache dir] [image-file1] ...\n");
+		exit(2);
+	}
+
 	/* setup */
 	signal(SIGINT, handle_interrupt);
 	disable_input_buffering();
+	if (!writer_start()) {
+		printf("Failed to start the output writer\n");
+		exit(1);
+	}
+	out_sink = writer_push;
 
-	/* set the PC to starting position */
-	/* 0x3000 is the default           */
-
-	enum { PC_START = 0x3000 };
-	reg[R_PC] = PC_START;
-
-	int running = 1;
-	while (running) {
-		/* FETCH */
-		uint16_t instr = mem_read(reg[R_PC]++);
-		uint16_t op = instr >> 12;
+	/* the profile is taken by the switch loop */
+	if (profile) {
+		interpreter = INTERP_SWITCH;
+	}
+	if (profile && !start_profile()) {
+		printf("Failed to allocate memory\n");
+		exit(1);
+	}
 
-		switch (op) {
-		case OP_ADD:
-			op_ADD(instr);
-			break;
-		case OP_AND:
-			op_AND(instr);
-			break;
-		case OP_NOT:
-			op_NOT(instr);
-			break;
-		case OP_BR:
-			op_BR(instr);
-			break;
-		case OP_JMP:
-			op_JMP(instr);
-			break;
-		case OP_JSR:
-			op_JSR(instr);
-			break;
-		case OP_LD:
-			op_LD(instr);
-			break;
-		case OP_LDI:
-			op_LDI(instr);
-			break;
-		case OP_LDR:
-			op_LDR(instr);
-			break;
-		case OP_LEA:
-			op_LEA(instr);
-			break;
-		case OP_ST:
-			op_ST(instr);
-			break;
-		case OP_STI:
-			op_STI(instr);
-			break;
-		case OP_STR:
-			op_STR(instr);
-			break;
-		case OP_TRAP:
-			switch (instr & 0xFF) {
-			case TRAP_GETC:
-				trap_GETC();
-				break;
-			case TRAP_OUT:
-				trap_OUT();
-				break;
-			case TRAP_PUTS:
-				trap_PUTS();
-				break;
-			case TRAP_IN:
-				trap_IN();
-				break;
-			case TRAP_PUTSP:
-				trap_PUTSP();
-				break;
-			case TRAP_HALT:
-				trap_HALT(&running);
-				break;
-			}
-			break;
-		case OP_RES:
-		case OP_RTI:
-		default:
-			abort();
-			break;
-		}
+	/* set the PC to starting position */
+	reset_vm();
+	if (!profile) {
+		load_translations();
+	}
+	run_program(budget);
+	if (!profile) {
+		save_translations();
 	}
 
 	/* shutdown */
+	if (interrupted) {
+		console_putc('\n');
+		console_flush();
+	}
+	writer_stop();
 	restore_input_buffering();
 
-	return 0;
+	if (stats) {
+		char line[512];
+		format_cache_stats(line, sizeof(line));
+		fputs(line, stderr);
+		print_hot_blocks(stderr, 10);
+	}
+	if (profile) {
+		print_op_profile();
+	}
+
+	return interrupted ? -2 : 0;
 }